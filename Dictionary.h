@@ -3,11 +3,24 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <Hashing.h>
 
+#ifdef DIC_LATENCY
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+#include <sched.h>
+#endif
+
 #define ERR_PREFIX DIC
 #include <Error.h>
 
@@ -20,26 +33,136 @@ enum _DIC_ErrorID {
     _DIC_ERRORID_ADDITEM_MALLOCKEY = 0x600020201,
     _DIC_ERRORID_ADDITEM_HASHTABLE = 0x600020202,
     _DIC_ERRORID_ADDITEM_MALLOCVALUE = 0x600020203,
+    _DIC_ERRORID_ADDITEM_LOG = 0x600020204,
     _DIC_ERRORID_DESTROYDICT_NODICT = 0x600030100,
     _DIC_ERRORID_CHECKITEM_HASHTABLE = 0x600040100,
     _DIC_ERRORID_GETITEM_HASHTABLE = 0x600050200,
     _DIC_ERRORID_GETITEM_NOITEM = 0x600050201,
     _DIC_ERRORID_REMOVEITEM_HASHTABLE = 0x600060200,
     _DIC_ERRORID_REMOVEITEM_NOITEM = 0x600060201,
+    _DIC_ERRORID_REMOVEITEM_COMPACT = 0x600060102,
+    _DIC_ERRORID_REMOVEITEM_LOG = 0x600060202,
     _DIC_ERRORID_ADDLIST_ADDITEM = 0x600070200,
     _DIC_ERRORID_COPYDICT_CREATE = 0x600080200,
     _DIC_ERRORID_COPYDICT_MALLOCLINK = 0x600080201,
     _DIC_ERRORID_COPYDICT_MALLOCKEY = 0x600080202,
-    _DIC_ERRORID_COPYDICT_MALLOCVALUE = 0x600080203
+    _DIC_ERRORID_COPYDICT_MALLOCVALUE = 0x600080203,
+    _DIC_ERRORID_COPYDICT_MALLOCFILTER = 0x600080204,
+    _DIC_ERRORID_COMPACTDICT_HASHTABLE = 0x600090200,
+    _DIC_ERRORID_COMPACTDICT_MALLOCLIST = 0x600090201,
+    _DIC_ERRORID_COMPACTDICT_MALLOCMEMORY = 0x600090202,
+    _DIC_ERRORID_CREATESHARDEDDICT_MALLOC = 0x6000A0200,
+    _DIC_ERRORID_CREATESHARDEDDICT_MALLOCSHARDS = 0x6000A0201,
+    _DIC_ERRORID_CREATESHARDEDDICT_CREATEDICT = 0x6000A0202,
+    _DIC_ERRORID_CREATESHARDEDDICT_LOCK = 0x6000A0203,
+    _DIC_ERRORID_CREATESHARDEDDICT_NOSHARDS = 0x6000A0204,
+    _DIC_ERRORID_SHARDEDADDITEM_HASHTABLE = 0x6000B0200,
+    _DIC_ERRORID_SHARDEDADDITEM_ADDITEM = 0x6000B0201,
+    _DIC_ERRORID_SHARDEDGETITEM_HASHTABLE = 0x6000C0200,
+    _DIC_ERRORID_SHARDEDGETITEM_GETITEM = 0x6000C0201,
+    _DIC_ERRORID_SHARDEDREMOVEITEM_HASHTABLE = 0x6000D0200,
+    _DIC_ERRORID_SHARDEDREMOVEITEM_REMOVEITEM = 0x6000D0201,
+    _DIC_ERRORID_SHARDEDCHECKITEM_HASHTABLE = 0x6000E0100,
+    _DIC_ERRORID_ATTACHFILTER_HASHTABLE = 0x6000F0200,
+    _DIC_ERRORID_ATTACHFILTER_MALLOC = 0x6000F0201,
+    _DIC_ERRORID_SAVEDICT_MALLOC = 0x600100200,
+    _DIC_ERRORID_SAVEDICT_OPEN = 0x600100201,
+    _DIC_ERRORID_SAVEDICT_WRITE = 0x600100202,
+    _DIC_ERRORID_SAVEDICT_RENAME = 0x600100203,
+    _DIC_ERRORID_SAVEDICT_SYNCDIR = 0x600100204,
+    _DIC_ERRORID_LOADDICT_OPEN = 0x600110200,
+    _DIC_ERRORID_LOADDICT_READ = 0x600110201,
+    _DIC_ERRORID_LOADDICT_FORMAT = 0x600110202,
+    _DIC_ERRORID_LOADDICT_CREATE = 0x600110203,
+    _DIC_ERRORID_LOADDICT_MALLOC = 0x600110204,
+    _DIC_ERRORID_LOADDICT_ADDITEM = 0x600110205,
+    _DIC_ERRORID_LOADDICT_FILTER = 0x600110206,
+    _DIC_ERRORID_OPENLOG_ALREADYOPEN = 0x600120200,
+    _DIC_ERRORID_OPENLOG_OPEN = 0x600120201,
+    _DIC_ERRORID_OPENLOG_FORMAT = 0x600120202,
+    _DIC_ERRORID_OPENLOG_WRITE = 0x600120203,
+    _DIC_ERRORID_COMMITLOG_NOLOG = 0x600130200,
+    _DIC_ERRORID_COMMITLOG_WRITE = 0x600130201,
+    _DIC_ERRORID_CLOSELOG_COMMIT = 0x600140200,
+    _DIC_ERRORID_RECOVERDICT_LOAD = 0x600150200,
+    _DIC_ERRORID_RECOVERDICT_CREATE = 0x600150201,
+    _DIC_ERRORID_RECOVERDICT_OPEN = 0x600150202,
+    _DIC_ERRORID_RECOVERDICT_FORMAT = 0x600150203,
+    _DIC_ERRORID_RECOVERDICT_MALLOC = 0x600150204,
+    _DIC_ERRORID_RECOVERDICT_ADDITEM = 0x600150205,
+    _DIC_ERRORID_RECOVERDICT_TRUNCATE = 0x600150206,
+    _DIC_ERRORID_COMPACTLOG_NOLOG = 0x600160200,
+    _DIC_ERRORID_COMPACTLOG_COMMIT = 0x600160201,
+    _DIC_ERRORID_COMPACTLOG_SAVE = 0x600160202,
+    _DIC_ERRORID_COMPACTLOG_TRUNCATE = 0x600160203,
+    _DIC_ERRORID_LOGRESERVE_MALLOC = 0x600170201,
+    _DIC_ERRORID_READENTRY_MALLOC = 0x600180200,
+    _DIC_ERRORID_ITERATESHARD_NOSHARD = 0x600190200,
+    _DIC_ERRORID_LOGRECORD_COMMIT = 0x6001A0200
 };
 
 #define _DIC_ERRORMES_MALLOC "Unable to allocate memory (Size: %lu)"
+#define _DIC_ERRORMES_ALLOCATOR "Custom allocator failed"
 #define _DIC_ERRORMES_CREATEHASH "Unable to create hash"
 #define _DIC_ERRORMES_WRONGDICTCOUNT "Attempting to destroy dict, but none is supposed to exist"
 #define _DIC_ERRORMES_NOHASHTABLE "No hash table is available (Expected number of dicts: %lu)"
 #define _DIC_ERRORMES_NOITEM "Unable to locate item"
 #define _DIC_ERRORMES_ADDITEM "Unable to add item"
 #define _DIC_ERRORMES_CREATEDICT "Unable to create new dict"
+#define _DIC_ERRORMES_COMPACTDICT "Unable to compact dict"
+#define _DIC_ERRORMES_GETITEM "Unable to get item"
+#define _DIC_ERRORMES_REMOVEITEM "Unable to remove item"
+#define _DIC_ERRORMES_CREATELOCK "Unable to create lock for shard %lu"
+#define _DIC_ERRORMES_NOSHARDS "A sharded dict needs at least one shard"
+#define _DIC_ERRORMES_NOSHARD "There is no shard %lu (Number of shards: %lu)"
+#define _DIC_ERRORMES_OPENFILE "Unable to open file \"%s\""
+#define _DIC_ERRORMES_WRITEFILE "Unable to write to file \"%s\""
+#define _DIC_ERRORMES_READFILE "Unable to read from file \"%s\""
+#define _DIC_ERRORMES_FILEFORMAT "File \"%s\" has the wrong format"
+#define _DIC_ERRORMES_RENAMEFILE "Unable to rename \"%s\" to \"%s\""
+#define _DIC_ERRORMES_TRUNCATEFILE "Unable to truncate log"
+#define _DIC_ERRORMES_SYNCDIR "Unable to sync the directory of \"%s\""
+#define _DIC_ERRORMES_WRITELOG "Unable to write to log"
+#define _DIC_ERRORMES_NOLOG "No log is open"
+#define _DIC_ERRORMES_LOGOPEN "A log is already open"
+#define _DIC_ERRORMES_LOADDICT "Unable to load dict"
+#define _DIC_ERRORMES_SAVEDICT "Unable to save dict"
+#define _DIC_ERRORMES_ATTACHFILTER "Unable to attach filter"
+
+// The size of a cache line, shards are padded to this to avoid false sharing
+#ifndef DIC_CACHELINE
+#define DIC_CACHELINE 64
+#endif
+
+// The number of filter counters to use per expected item and the number of counters set for each item
+#define _DIC_FILTERCOUNTERS 10
+#define _DIC_FILTERPROBES 4
+
+// The first bytes of snapshot and log files
+#define _DIC_SNAPSHOTHEADER "DICSNP01"
+#define _DIC_LOGHEADER "DICLOG01"
+#define _DIC_HEADERSIZE 8
+
+// The types of log records
+#define _DIC_LOGTYPE_ADD 1
+#define _DIC_LOGTYPE_REMOVE 2
+
+#ifdef DIC_LATENCY
+// Each power of 2 of the latency histograms is split into 2^_DIC_LATENCYSUBBITS buckets
+#define _DIC_LATENCYSUBBITS 4
+#define _DIC_LATENCYBUCKETS ((64 - _DIC_LATENCYSUBBITS + 1) << _DIC_LATENCYSUBBITS)
+#endif
+
+// Rounds a size up such that the next value placed after it is aligned for any type
+#define _DIC_ALIGNSIZE(Size) (((Size) + _Alignof(max_align_t) - 1) / _Alignof(max_align_t) * _Alignof(max_align_t))
+
+// Allocates, resizes and frees memory using the allocator of a dict
+#define _DIC_MALLOC(Dict, Size) ((Dict)->allocator.alloc((Dict)->allocator.context, (Size)))
+#define _DIC_REALLOC(Dict, Pointer, Size) ((Dict)->allocator.realloc((Dict)->allocator.context, (Pointer), (Size)))
+#define _DIC_FREE(Dict, Pointer) ((Dict)->allocator.free((Dict)->allocator.context, (Pointer)))
+
+// Finds the reason an allocation failed, custom allocators are not expected to set errno
+#define _DIC_ALLOCERROR(Allocator) (((Allocator)->alloc == &_DIC_DefaultAlloc && (Allocator)->realloc == &_DIC_DefaultRealloc) ? strerror(errno) : _DIC_ERRORMES_ALLOCATOR)
 
 enum __DIC_Mode {
     DIC_MODE_POINTER,
@@ -52,24 +175,124 @@ typedef enum __DIC_Mode DIC_Mode;
 typedef enum __DIC_Type DIC_Type;
 typedef struct __DIC_Dict DIC_Dict;
 typedef struct __DIC_LinkList DIC_LinkList;
+typedef struct __DIC_Allocator DIC_Allocator;
+typedef struct __DIC_Filter DIC_Filter;
+typedef struct __DIC_Log DIC_Log;
+
+#ifdef DIC_LATENCY
+enum __DIC_Operation {
+    DIC_OPERATION_ADDITEM,
+    DIC_OPERATION_GETITEM,
+    DIC_OPERATION_REMOVEITEM,
+    DIC_OPERATION_CHECKITEM,
+    DIC_OPERATION_COUNT
+};
+
+typedef enum __DIC_Operation DIC_Operation;
+typedef struct __DIC_Latency DIC_Latency;
+typedef struct __DIC_SlowHook DIC_SlowHook;
+
+// Called for every timed operation taking at least the threshold
+// Operation: The operation which was slow
+// Key: The key used for the operation
+// ChainLength: The number of items in the list holding the key after the operation
+// Ticks: The time used, in cycles if the TSC is available, otherwise in nanoseconds
+// Data: The user data given with the hook
+typedef void (*DIC_LatencyHook)(DIC_Operation Operation, const char *Key, size_t ChainLength, uint64_t Ticks, void *Data);
+#endif
+typedef struct __DIC_Shard DIC_Shard;
+typedef struct __DIC_ShardedDict DIC_ShardedDict;
+
+struct __DIC_Allocator {
+    void *(*alloc)(void *Context, size_t Size); // Allocates Size bytes, returns NULL on failure
+    void *(*realloc)(void *Context, void *Pointer, size_t Size); // Resizes an allocation to Size bytes, Pointer may be NULL, returns NULL on failure and leaves the old allocation untouched
+    void (*free)(void *Context, void *Pointer); // Frees an allocation
+    void *context; // User data given to all of the functions
+};
+
+struct __DIC_Filter {
+    uint8_t *counters; // Blocks of 4 bit counters, each block fills one cache line and all counters of a key are in the same block
+    void *memory; // The memory holding the counters
+    size_t count; // The number of blocks, if 0 then there is no filter
+};
+
+struct __DIC_Log {
+    FILE *file; // The file the records are appended to, if NULL then there is no log
+    uint8_t *buffer; // Records which have not been written to the file yet
+    size_t used; // The number of bytes used in the buffer
+    size_t size; // The size of the buffer
+    size_t records; // The number of records in the buffer
+    size_t batch; // The number of records to collect before writing them to the file
+    off_t committed; // The size of the file when the last commit finished, a failed commit truncates back to it
+    bool torn; // True if a failed commit left part of its records in the file
+};
 
 struct __DIC_LinkList {
     char *key; // The key for the item
     void *value; // A pointer to the value
     size_t size; // The size of the value, only used if pointer is false
     bool pointer; // If it is false then it contains a pointer to private information which must be freed when dict is destroyed
+    bool copy; // If it is true then the value is a private copy made by the dict (DIC_MODE_COPY)
+    bool compact; // If it is true then the link and the key are stored in the compact memory of the dict and must not be freed individually
+    bool compactValue; // If it is true then the value is stored in the compact memory of the dict and must not be freed individually
     DIC_LinkList *next; // The next element in the list
 };
 
 struct __DIC_Dict {
     DIC_LinkList **list;
     size_t length;
+    size_t count; // The number of items in the dict
+    void *compact; // The memory holding all of the links compacted by DIC_CompactDict
+    double compactLoad; // If larger than 0, then the dict is compacted when the number of items per list drops below this after removing an item
+    size_t compactMin; // The smallest size of the dict list when it is compacted automatically
+    DIC_Allocator allocator; // The allocator used for all memory owned by the dict
+    DIC_Filter filter; // Counting filter used to find missing keys without going through the list
+    DIC_Log log; // Log of all changes to the items with values owned by the dict
+};
+
+struct __DIC_Shard {
+    pthread_mutex_t lock; // The lock which must be held while using the dict
+    DIC_Dict *dict; // The dict holding the items of this shard
+    uint8_t padding[DIC_CACHELINE - (sizeof(pthread_mutex_t) + sizeof(DIC_Dict *)) % DIC_CACHELINE]; // Keeps the shards on separate cache lines
+};
+
+struct __DIC_ShardedDict {
+    DIC_Shard *shards; // The shards, aligned to a cache line
+    void *memory; // The memory holding the shards
+    size_t count; // The number of shards
+    DIC_Allocator allocator; // The allocator used for all memory owned by the sharded dict
+};
+
+#ifdef DIC_LATENCY
+struct __DIC_Latency {
+    uint64_t counts[DIC_OPERATION_COUNT][_DIC_LATENCYBUCKETS]; // The number of samples in each bucket, only written by the thread owning the histograms, other threads read them with relaxed atomics
+    uint64_t total[DIC_OPERATION_COUNT]; // The sum of all samples
+    uint64_t max[DIC_OPERATION_COUNT]; // The longest sample
+    uint64_t calls; // The number of operations on this thread, used to pick the samples
+    uint64_t reset; // Increased by DIC_ResetLatency to ask the owning thread to clear the histograms
+    uint64_t cleared; // The value of reset when the owning thread last cleared the histograms, they are left out while it differs from reset
+    bool inHook; // True while the owning thread reads or calls the slow hook
+    uint64_t hookGeneration; // The generation of the slow hook the owning thread is calling, only valid while inHook is true
+    DIC_Allocator allocator; // The allocator used for this struct
+    DIC_Latency *next; // The histograms of the next thread
+};
+
+struct __DIC_SlowHook {
+    uint64_t threshold; // The minimum number of ticks for an operation to be slow
+    DIC_LatencyHook hook; // The function to call
+    void *data; // User data given to the hook
 };
+#endif
 
 // Creates a empty dictionary
 // Size: The size of the dict list, this should be about the same size as the expected number of entries
 DIC_Dict *DIC_CreateDict(size_t Size);
 
+// Creates a empty dictionary which gets all of its memory from an allocator
+// Size: The size of the dict list, this should be about the same size as the expected number of entries
+// Allocator: The allocator to use for the dict, the links, the keys and the copied values, values added with DIC_MODE_INSERT must come from malloc and are freed with free, if NULL then malloc and free are used
+DIC_Dict *DIC_CreateDictEx(size_t Size, const DIC_Allocator *Allocator);
+
 // Add an item to a dictionary
 // Dict: The dictionary to add the item to
 // Key: The key for the item
@@ -110,36 +333,655 @@ DIC_Dict *DIC_CopyDict(DIC_Dict *Dict);
 // Dict: The dict to get the length of
 size_t DIC_DictLength(DIC_Dict *Dict);
 
+// Rebuilds the dict list and moves all of the links, keys and copied values into one block of memory, ordered by their position in the list
+// Dict: The dict to compact
+// Size: The new size of the dict list, if 0 then it is set to the number of elements in the dict
+bool DIC_CompactDict(DIC_Dict *Dict, size_t Size);
+
+// Sets the policy for automatically compacting a dict when removing items, the dict list is shrunk to twice MinLoad items per list such that it takes many removals before it is compacted again
+// Dict: The dict to set the policy for
+// MinLoad: When the number of elements per list drops below this, the dict is compacted, if 0 it is never compacted automatically, values above 0.5 are used as 0.5
+// MinSize: The dict list is never compacted automatically to fewer lists than this, as items added later do not grow the list again, if 0 then the current size of the list is used
+void DIC_SetCompactPolicy(DIC_Dict *Dict, double MinLoad, size_t MinSize);
+
+// Attaches a counting filter to the dict which answers most lookups of missing keys from a single cache line, it is kept up to date when adding and removing items, an old filter is replaced
+// Dict: The dict to attach the filter to
+// ExpectedCount: The expected number of items in the dict, the filter is never made for fewer than the current number of items
+bool DIC_AttachFilter(DIC_Dict *Dict, size_t ExpectedCount);
+
+// Removes the filter from a dict
+// Dict: The dict to remove the filter from
+void DIC_DetachFilter(DIC_Dict *Dict);
+
+// Saves a snapshot of the dict and its filter, only items with values owned by the dict (DIC_MODE_COPY and DIC_MODE_INSERT) are saved, the file is replaced atomically and the directory is synced before returning
+// Dict: The dict to save
+// Path: The path of the snapshot
+bool DIC_SaveDict(DIC_Dict *Dict, const char *Path);
+
+// Loads a snapshot saved with DIC_SaveDict, all values are copied into the new dict
+// Path: The path of the snapshot
+// Allocator: The allocator to use for the dict, if NULL then malloc and free are used
+DIC_Dict *DIC_LoadDict(const char *Path, const DIC_Allocator *Allocator);
+
+// Starts appending all changes of items with values owned by the dict to a log, adding an item with DIC_MODE_POINTER is logged as a removal since the pointer cannot be saved
+// Dict: The dict to log
+// Path: The path of the log, if it exists then the records are added to the end
+// Batch: The number of records to collect in memory before writing them together, the change filling a batch writes it before returning, if that fails the change is still made but false is returned and the records are kept for the next commit
+bool DIC_OpenLog(DIC_Dict *Dict, const char *Path, size_t Batch);
+
+// Writes all records collected in memory to the log and waits for them to reach the disk, if it fails then the log is cut back to the last commit such that it can be retried
+// Dict: The dict with the log
+bool DIC_CommitLog(DIC_Dict *Dict);
+
+// Commits and closes the log
+// Dict: The dict with the log
+bool DIC_CloseLog(DIC_Dict *Dict);
+
+// Folds the log into a new snapshot and empties the log, a crash at any point leaves a snapshot and log which recover to the current dict
+// Dict: The dict with the log
+// SnapshotPath: The path of the snapshot
+bool DIC_CompactLog(DIC_Dict *Dict, const char *SnapshotPath);
+
+// Loads the last snapshot and replays the log on top of it, a partially written record at the end of the log is cut off such that records appended after reopening the log are read again, the log is not opened for the new dict
+// SnapshotPath: The path of the snapshot, if it does not exist an empty dict is used
+// LogPath: The path of the log, if it does not exist then only the snapshot is loaded
+// Size: The size of the dict list if there is no snapshot
+// Allocator: The allocator to use for the dict, if NULL then malloc and free are used
+DIC_Dict *DIC_RecoverDict(const char *SnapshotPath, const char *LogPath, size_t Size, const DIC_Allocator *Allocator);
+
+// Creates a empty dictionary split into a number of shards which can be used from different threads at the same time, each key is put into a shard by the high bits of its hash
+// Missing items are reported only through the return values and do not touch the error state, other failures (allocation, the log) still set the shared error state, so it must be thread safe if those can happen on several threads at once
+// ShardCount: The number of shards, must be at least 1 and should be at least the number of threads using the dict
+// Size: The total size of the dict lists, it is split evenly between the shards
+// Allocator: The allocator to use for the shards and their dicts, if NULL then malloc and free are used
+DIC_ShardedDict *DIC_CreateShardedDict(size_t ShardCount, size_t Size, const DIC_Allocator *Allocator);
+
+// Add an item to a sharded dictionary, only the shard of the key is locked
+// Dict: The dictionary to add the item to
+// Key: The key for the item
+// Value: A pointer to the value to store
+// ValueLength: The size of the value data, only used if mode is not DIC_MODE_POINTER
+// Mode: The same as for DIC_AddItem
+bool DIC_ShardedAddItem(DIC_ShardedDict *Dict, const char *Key, void *Value, size_t ValueLength, DIC_Mode Mode);
+
+// Remove an item from a sharded dictionary, returns false without setting an error if the item does not exist
+// Dict: The dictionary to remove an item from
+// Key: The key for the item
+bool DIC_ShardedRemoveItem(DIC_ShardedDict *Dict, const char *Key);
+
+// Get an item from a sharded dictionary, the value is not protected by the lock after returning, returns NULL without setting an error if the item does not exist
+// Dict: The dictionary to get an item from
+// Key: The key for the item
+void *DIC_ShardedGetItem(DIC_ShardedDict *Dict, const char *Key);
+
+// Checks if an item exists in a sharded dictionary
+// Dict: The dictionary to look in
+// Key: The key for the item
+bool DIC_ShardedCheckItem(DIC_ShardedDict *Dict, const char *Key);
+
+// Returns the number of elements in the sharded dictionary
+// Dict: The dict to get the length of
+size_t DIC_ShardedDictLength(DIC_ShardedDict *Dict);
+
+// Goes through all of the items in one shard while holding its lock, different shards may be iterated from different threads at the same time
+// Dict: The dict to iterate
+// Shard: The index of the shard to iterate, must be less than the number of shards
+// Callback: The function to call for each item, the iteration stops if it returns false, it must not use the same shard
+// Data: User data given to the callback
+// Returns false if the callback stopped the iteration or the shard does not exist
+bool DIC_IterateShard(DIC_ShardedDict *Dict, size_t Shard, bool (*Callback)(const char *Key, void *Value, size_t Size, void *Data), void *Data);
+
+#ifdef DIC_LATENCY
+// Sets how often operations are timed, all timed operations are added to the histograms of the calling thread, operations on sharded dicts are timed as the matching operation on a dict while holding the shard lock
+// Rate: Every Rate'th operation on each thread is timed, if 0 then nothing is timed
+void DIC_SetLatencySampling(uint64_t Rate);
+
+// Sets a hook to call for slow operations, only timed operations are checked, it returns when no other thread is calling the old hook such that its data may be freed
+// The hook is not called for operations made by the hook itself and it must not call any of the latency functions except DIC_SetLatencySampling
+// Hook: The hook to use, it is copied, if NULL then no hook is used
+void DIC_SetLatencyHook(const DIC_SlowHook *Hook);
+
+// Sets the allocator for the histograms of threads which have not timed any operations yet, the histograms of a thread are freed when it exits after adding its samples to the combined histograms of all exited threads
+// Allocator: The allocator to use, if NULL then malloc and free are used
+void DIC_SetLatencyAllocator(const DIC_Allocator *Allocator);
+
+// Writes the count, mean, percentiles and maximum time of each operation for all threads combined, including threads which have exited
+// File: The file to write to
+void DIC_DumpLatency(FILE *File);
+
+// Clears the histograms of all threads, each running thread clears its own histograms at its next timed operation and they are left out until then
+void DIC_ResetLatency(void);
+#endif
+
 void DIC_InitLinkList(DIC_LinkList *Struct);
 void DIC_InitDict(DIC_Dict *Struct);
 
+void DIC_InitAllocator(DIC_Allocator *Struct);
+void DIC_InitShardedDict(DIC_ShardedDict *Struct);
+void DIC_InitFilter(DIC_Filter *Struct);
+void DIC_InitLog(DIC_Log *Struct);
+#ifdef DIC_LATENCY
+void DIC_InitSlowHook(DIC_SlowHook *Struct);
+#endif
+
 void DIC_DestroyLinkList(DIC_LinkList *LinkList);
 void DIC_DestroyDict(DIC_Dict *Dict);
+void DIC_DestroyShardedDict(DIC_ShardedDict *Dict);
 
 HAS_Hash *_DIC_HashTable = NULL;
 size_t _DIC_DictCount = 0;
 
+#ifdef DIC_LATENCY
+DIC_Latency *_DIC_LatencyList = NULL;
+DIC_Latency _DIC_LatencyRetired; // The combined histograms of all exited threads, only used while holding the lock
+DIC_Allocator _DIC_LatencyAllocator = {.alloc = NULL}; // If alloc is NULL then malloc and free are used
+pthread_mutex_t _DIC_LatencyLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t _DIC_LatencyOnce = PTHREAD_ONCE_INIT;
+pthread_key_t _DIC_LatencyKey;
+bool _DIC_LatencyHasKey = false;
+_Thread_local DIC_Latency *_DIC_LatencyThread = NULL;
+uint64_t _DIC_LatencyRate = 1;
+DIC_SlowHook _DIC_LatencyHooks[2]; // The slow hook is in the slot given by the lowest bit of the generation, the other slot is written when it is replaced
+uint64_t _DIC_LatencyHookGeneration = 0; // Increased every time the slow hook is replaced
+
+uint64_t _DIC_LatencyTicks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec Time;
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+
+    return (uint64_t)Time.tv_sec * 1000000000ULL + (uint64_t)Time.tv_nsec;
+#endif
+}
+
+// Finds the histogram bucket of a time, the first bucket of each power of 2 starts at that power of 2
+size_t _DIC_LatencyBucket(uint64_t Ticks)
+{
+    if (Ticks < (1ULL << _DIC_LATENCYSUBBITS))
+        return Ticks;
+
+    size_t Power = 63 - __builtin_clzll(Ticks);
+    size_t Sub = (Ticks >> (Power - _DIC_LATENCYSUBBITS)) & ((1ULL << _DIC_LATENCYSUBBITS) - 1);
+
+    return ((Power - _DIC_LATENCYSUBBITS + 1) << _DIC_LATENCYSUBBITS) + Sub;
+}
+
+// Finds the smallest time in a histogram bucket
+uint64_t _DIC_LatencyValue(size_t Bucket)
+{
+    size_t Power = Bucket >> _DIC_LATENCYSUBBITS;
+    uint64_t Sub = Bucket & ((1ULL << _DIC_LATENCYSUBBITS) - 1);
+
+    if (Power == 0)
+        return Sub;
+
+    return ((1ULL << _DIC_LATENCYSUBBITS) + Sub) << (Power - 1);
+}
+
+// Adds the samples of one operation to combined histograms, histograms waiting to be cleared by their thread are left out
+void _DIC_LatencyCombine(DIC_Latency *Latency, size_t Operation, uint64_t *Counts, uint64_t *Total, uint64_t *Max)
+{
+    if (__atomic_load_n(&Latency->cleared, __ATOMIC_ACQUIRE) != __atomic_load_n(&Latency->reset, __ATOMIC_RELAXED))
+        return;
+
+    for (size_t Bucket = 0; Bucket < _DIC_LATENCYBUCKETS; ++Bucket)
+        Counts[Bucket] += __atomic_load_n(&Latency->counts[Operation][Bucket], __ATOMIC_RELAXED);
+
+    *Total += __atomic_load_n(&Latency->total[Operation], __ATOMIC_RELAXED);
+    uint64_t LatencyMax = __atomic_load_n(&Latency->max[Operation], __ATOMIC_RELAXED);
+
+    if (LatencyMax > *Max)
+        *Max = LatencyMax;
+}
+
+// Moves the samples of an exiting thread to the retired histograms and frees its histograms
+void _DIC_LatencyExit(void *Data)
+{
+    DIC_Latency *Latency = (DIC_Latency *)Data;
+    _DIC_LatencyThread = NULL;
+
+    pthread_mutex_lock(&_DIC_LatencyLock);
+
+    for (DIC_Latency **LatencyPos = &_DIC_LatencyList; *LatencyPos != NULL; LatencyPos = &(*LatencyPos)->next)
+        if (*LatencyPos == Latency)
+        {
+            *LatencyPos = Latency->next;
+            break;
+        }
+
+    for (size_t Operation = 0; Operation < DIC_OPERATION_COUNT; ++Operation)
+        _DIC_LatencyCombine(Latency, Operation, _DIC_LatencyRetired.counts[Operation], _DIC_LatencyRetired.total + Operation, _DIC_LatencyRetired.max + Operation);
+
+    pthread_mutex_unlock(&_DIC_LatencyLock);
+
+    _DIC_FREE(Latency, Latency);
+}
+
+void _DIC_LatencyCreateKey(void)
+{
+    _DIC_LatencyHasKey = (pthread_key_create(&_DIC_LatencyKey, &_DIC_LatencyExit) == 0);
+}
+
+// Creates the histograms for this thread, they are freed by _DIC_LatencyExit when the thread exits
+bool _DIC_LatencyRegister(void)
+{
+    if (pthread_once(&_DIC_LatencyOnce, &_DIC_LatencyCreateKey) != 0 || !_DIC_LatencyHasKey)
+        return false;
+
+    pthread_mutex_lock(&_DIC_LatencyLock);
+    DIC_Allocator Allocator = _DIC_LatencyAllocator;
+    pthread_mutex_unlock(&_DIC_LatencyLock);
+
+    if (Allocator.alloc == NULL)
+        DIC_InitAllocator(&Allocator);
+
+    DIC_Latency *Latency = (DIC_Latency *)Allocator.alloc(Allocator.context, sizeof(DIC_Latency));
+
+    if (Latency == NULL)
+        return false;
+
+    memset(Latency, 0, sizeof(DIC_Latency));
+    Latency->allocator = Allocator;
+
+    if (pthread_setspecific(_DIC_LatencyKey, Latency) != 0)
+    {
+        _DIC_FREE(Latency, Latency);
+        return false;
+    }
+
+    pthread_mutex_lock(&_DIC_LatencyLock);
+    Latency->next = _DIC_LatencyList;
+    _DIC_LatencyList = Latency;
+    pthread_mutex_unlock(&_DIC_LatencyLock);
+
+    _DIC_LatencyThread = Latency;
+
+    return true;
+}
+
+// Starts timing an operation, returns 0 if it is not sampled
+uint64_t _DIC_LatencyStart(void)
+{
+    uint64_t Rate = __atomic_load_n(&_DIC_LatencyRate, __ATOMIC_RELAXED);
+
+    if (Rate == 0)
+        return 0;
+
+    if (_DIC_LatencyThread == NULL && !_DIC_LatencyRegister())
+        return 0;
+
+    if (_DIC_LatencyThread->calls++ % Rate != 0)
+        return 0;
+
+    return _DIC_LatencyTicks();
+}
+
+// Adds to a counter of the histograms of this thread, it is the only writer so no atomic read-modify-write is needed
+void _DIC_LatencyAdd(uint64_t *Counter, uint64_t Amount)
+{
+    __atomic_store_n(Counter, __atomic_load_n(Counter, __ATOMIC_RELAXED) + Amount, __ATOMIC_RELAXED);
+}
+
+// Clears the histograms of this thread if DIC_ResetLatency has asked for it
+void _DIC_LatencyClear(DIC_Latency *Latency)
+{
+    uint64_t Reset = __atomic_load_n(&Latency->reset, __ATOMIC_ACQUIRE);
+
+    if (Reset == Latency->cleared)
+        return;
+
+    for (size_t Operation = 0; Operation < DIC_OPERATION_COUNT; ++Operation)
+    {
+        for (size_t Bucket = 0; Bucket < _DIC_LATENCYBUCKETS; ++Bucket)
+            __atomic_store_n(&Latency->counts[Operation][Bucket], 0, __ATOMIC_RELAXED);
+
+        __atomic_store_n(&Latency->total[Operation], 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&Latency->max[Operation], 0, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&Latency->cleared, Reset, __ATOMIC_RELEASE);
+}
+
+// Finds the number of items in the list holding a key
+size_t _DIC_ChainLength(DIC_Dict *Dict, const char *Key)
+{
+    extern HAS_Hash *_DIC_HashTable;
+
+    if (_DIC_HashTable == NULL)
+        return 0;
+
+    size_t Length = 0;
+
+    for (DIC_LinkList *Link = Dict->list[HAS_HashValue(_DIC_HashTable, (uint8_t *)Key, strlen(Key)) % Dict->length]; Link != NULL; Link = Link->next)
+        ++Length;
+
+    return Length;
+}
+
+// Copies the slow hook and returns its generation, the copy is made again if the hook is replaced while copying
+uint64_t _DIC_LatencyGetHook(DIC_SlowHook *Hook)
+{
+    uint64_t Generation;
+
+    do
+    {
+        Generation = __atomic_load_n(&_DIC_LatencyHookGeneration, __ATOMIC_SEQ_CST);
+        DIC_SlowHook *Slot = _DIC_LatencyHooks + (Generation & 1);
+
+        Hook->threshold = __atomic_load_n(&Slot->threshold, __ATOMIC_RELAXED);
+        Hook->hook = __atomic_load_n(&Slot->hook, __ATOMIC_RELAXED);
+        Hook->data = __atomic_load_n(&Slot->data, __ATOMIC_RELAXED);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&_DIC_LatencyHookGeneration, __ATOMIC_RELAXED) != Generation);
+
+    return Generation;
+}
+
+// Adds the time of an operation to the histograms and calls the hook if it was slow
+void _DIC_LatencyStop(DIC_Operation Operation, uint64_t Start, DIC_Dict *Dict, const char *Key)
+{
+    if (Start == 0)
+        return;
+
+    uint64_t Ticks = _DIC_LatencyTicks() - Start;
+    DIC_Latency *Latency = _DIC_LatencyThread;
+
+    _DIC_LatencyClear(Latency);
+    _DIC_LatencyAdd(&Latency->counts[Operation][_DIC_LatencyBucket(Ticks)], 1);
+    _DIC_LatencyAdd(&Latency->total[Operation], Ticks);
+
+    if (Ticks > Latency->max[Operation])
+        __atomic_store_n(&Latency->max[Operation], Ticks, __ATOMIC_RELAXED);
+
+    // The hook is not called again for operations made by the hook itself
+    if (Latency->inHook)
+        return;
+
+    // Tell DIC_SetLatencyHook that this thread may use the hook before reading it
+    __atomic_store_n(&Latency->inHook, true, __ATOMIC_SEQ_CST);
+
+    DIC_SlowHook Hook;
+    __atomic_store_n(&Latency->hookGeneration, _DIC_LatencyGetHook(&Hook), __ATOMIC_SEQ_CST);
+
+    if (Hook.hook != NULL && Ticks >= Hook.threshold)
+        Hook.hook(Operation, Key, _DIC_ChainLength(Dict, Key), Ticks, Hook.data);
+
+    __atomic_store_n(&Latency->inHook, false, __ATOMIC_RELEASE);
+}
+#endif
+
+void *_DIC_DefaultAlloc(void *Context, size_t Size)
+{
+    return malloc(Size);
+}
+
+void *_DIC_DefaultRealloc(void *Context, void *Pointer, size_t Size)
+{
+    return realloc(Pointer, Size);
+}
+
+void _DIC_DefaultFree(void *Context, void *Pointer)
+{
+    free(Pointer);
+}
+
+// Gets zeroed memory for the counters of a filter aligned to a cache line
+bool _DIC_CreateFilter(DIC_Dict *Dict, DIC_Filter *Filter, size_t Count)
+{
+    DIC_InitFilter(Filter);
+
+    Filter->memory = _DIC_MALLOC(Dict, DIC_CACHELINE * (Count + 1) - 1);
+
+    if (Filter->memory == NULL)
+        return false;
+
+    Filter->counters = (uint8_t *)(((uintptr_t)Filter->memory + DIC_CACHELINE - 1) / DIC_CACHELINE * DIC_CACHELINE);
+    Filter->count = Count;
+    memset(Filter->counters, 0, DIC_CACHELINE * Count);
+
+    return true;
+}
+
+// Mixes the hash such that the filter does not depend on the same bits as the dict list and the shards
+uint64_t _DIC_FilterMix(uint64_t HashKey)
+{
+    HashKey ^= HashKey >> 33;
+    HashKey *= 0xff51afd7ed558ccdULL;
+    HashKey ^= HashKey >> 33;
+    HashKey *= 0xc4ceb9fe1a85ec53ULL;
+    HashKey ^= HashKey >> 33;
+
+    return HashKey;
+}
+
+// Changes the counters of a key, the high bits select the block and each probe uses 8 of the low bits, returns false if any of the counters were 0 before
+// Filter: The filter to use
+// HashKey: The hash of the key
+// Change: 1 to add the key, -1 to remove it and 0 to only check it
+bool _DIC_FilterUpdate(DIC_Filter *Filter, uint64_t HashKey, int Change)
+{
+    uint64_t Mix = _DIC_FilterMix(HashKey);
+    uint8_t *Block = Filter->counters + DIC_CACHELINE * ((Mix >> 32) % Filter->count);
+    bool Found = true;
+
+    for (size_t Probe = 0; Probe < _DIC_FILTERPROBES; ++Probe, Mix >>= 8)
+    {
+        size_t Counter = (Mix & 0xFF) % (2 * DIC_CACHELINE);
+        uint8_t *Byte = Block + Counter / 2;
+        uint8_t Shift = (Counter % 2) * 4;
+        uint8_t Value = (*Byte >> Shift) & 0xF;
+
+        if (Value == 0)
+            Found = false;
+
+        // Saturated counters are never changed since their real value is unknown
+        if (Value == 0xF || (Change < 0 && Value == 0))
+            continue;
+
+        Value += Change;
+        *Byte = (*Byte & ~(0xF << Shift)) | (Value << Shift);
+    }
+
+    return Found;
+}
+
+// Finds the size of a log record or snapshot entry, the value is only included if HasValue is true
+size_t _DIC_EntrySize(size_t KeyLength, size_t ValueLength, bool HasValue)
+{
+    if (!HasValue)
+        return sizeof(uint32_t) + KeyLength;
+
+    return sizeof(uint32_t) + sizeof(uint64_t) + KeyLength + ValueLength;
+}
+
+// Makes room for a record in the log buffer
+bool _DIC_LogReserve(DIC_Dict *Dict, size_t Size)
+{
+    if (Dict->log.used + Size <= Dict->log.size)
+        return true;
+
+    // Grow the buffer
+    size_t NewSize = 2 * Dict->log.size;
+
+    if (NewSize < Dict->log.used + Size)
+        NewSize = Dict->log.used + Size;
+
+    uint8_t *NewBuffer = (uint8_t *)_DIC_REALLOC(Dict, Dict->log.buffer, NewSize);
+
+    if (NewBuffer == NULL)
+    {
+        _DIC_AddErrorForeign(_DIC_ERRORID_LOGRESERVE_MALLOC, _DIC_ALLOCERROR(&Dict->allocator), _DIC_ERRORMES_MALLOC, NewSize);
+        return false;
+    }
+
+    Dict->log.buffer = NewBuffer;
+    Dict->log.size = NewSize;
+
+    return true;
+}
+
+// Writes a record to the log buffer and writes the buffer to the file if the batch is full, room must have been made with _DIC_LogReserve
+bool _DIC_LogRecord(DIC_Dict *Dict, uint8_t Type, const char *Key, size_t KeyLength, const void *Value, size_t ValueLength)
+{
+    DIC_Log *Log = &Dict->log;
+    uint8_t *Record = Log->buffer + Log->used;
+    uint32_t RecordKeyLength = KeyLength;
+    uint64_t RecordValueLength = ValueLength;
+
+    *Record++ = Type;
+    memcpy(Record, &RecordKeyLength, sizeof(uint32_t));
+    Record += sizeof(uint32_t);
+
+    if (Type == _DIC_LOGTYPE_ADD)
+    {
+        memcpy(Record, &RecordValueLength, sizeof(uint64_t));
+        Record += sizeof(uint64_t);
+    }
+
+    memcpy(Record, Key, KeyLength);
+    Record += KeyLength;
+
+    if (Type == _DIC_LOGTYPE_ADD && ValueLength > 0)
+    {
+        memcpy(Record, Value, ValueLength);
+        Record += ValueLength;
+    }
+
+    Log->used = Record - Log->buffer;
+    ++Log->records;
+
+    // Write the batch
+    if (Log->records >= Log->batch && !DIC_CommitLog(Dict))
+    {
+        _DIC_AddError(_DIC_ERRORID_LOGRECORD_COMMIT, _DIC_ERRORMES_WRITELOG);
+        return false;
+    }
+
+    return true;
+}
+
+// Writes a snapshot entry to a file
+bool _DIC_WriteEntry(FILE *File, const char *Key, size_t KeyLength, const void *Value, size_t ValueLength)
+{
+    uint32_t EntryKeyLength = KeyLength;
+    uint64_t EntryValueLength = ValueLength;
+
+    return fwrite(&EntryKeyLength, sizeof(uint32_t), 1, File) == 1 && fwrite(&EntryValueLength, sizeof(uint64_t), 1, File) == 1 && fwrite(Key, sizeof(char), KeyLength, File) == KeyLength && (ValueLength == 0 || fwrite(Value, 1, ValueLength, File) == ValueLength);
+}
+
+// Reads a log record or snapshot entry into a buffer which is grown when needed, the key is null terminated and followed by the value
+// Returns false if the file ended before the entry was complete or if the buffer could not be grown in which case OutOfMemory is set to true
+bool _DIC_ReadEntry(DIC_Dict *Dict, FILE *File, bool HasValue, uint8_t **Buffer, size_t *BufferSize, size_t *ValueLength, bool *OutOfMemory)
+{
+    uint32_t EntryKeyLength;
+    uint64_t EntryValueLength = 0;
+    *OutOfMemory = false;
+
+    if (fread(&EntryKeyLength, sizeof(uint32_t), 1, File) != 1)
+        return false;
+
+    if (HasValue && fread(&EntryValueLength, sizeof(uint64_t), 1, File) != 1)
+        return false;
+
+    // Grow the buffer
+    size_t Size = EntryKeyLength + 1 + EntryValueLength;
+
+    if (Size > *BufferSize)
+    {
+        uint8_t *NewBuffer = (uint8_t *)_DIC_REALLOC(Dict, *Buffer, Size);
+
+        if (NewBuffer == NULL)
+        {
+            _DIC_AddErrorForeign(_DIC_ERRORID_READENTRY_MALLOC, _DIC_ALLOCERROR(&Dict->allocator), _DIC_ERRORMES_MALLOC, Size);
+            *OutOfMemory = true;
+            return false;
+        }
+
+        *Buffer = NewBuffer;
+        *BufferSize = Size;
+    }
+
+    // Read the key and value
+    if (fread(*Buffer, sizeof(char), EntryKeyLength, File) != EntryKeyLength)
+        return false;
+
+    (*Buffer)[EntryKeyLength] = '\0';
+
+    if (EntryValueLength > 0 && fread(*Buffer + EntryKeyLength + 1, 1, EntryValueLength, File) != EntryValueLength)
+        return false;
+
+    *ValueLength = EntryValueLength;
+
+    return true;
+}
+
+// Frees a value owned by the dict, copies are made with the allocator of the dict while inserted values come from malloc
+void _DIC_FreeValue(DIC_Dict *Dict, DIC_LinkList *Link)
+{
+    if (Link->copy)
+        _DIC_FREE(Dict, Link->value);
+
+    else
+        free(Link->value);
+}
+
+// Destroys a chain of links owned by a dict with the allocator of the dict
+void _DIC_DestroyLinkList(DIC_Dict *Dict, DIC_LinkList *LinkList)
+{
+    // Destroy the key
+    if (!LinkList->compact && LinkList->key != NULL)
+        _DIC_FREE(Dict, LinkList->key);
+
+    if (!LinkList->pointer && !LinkList->compactValue && LinkList->value != NULL)
+        _DIC_FreeValue(Dict, LinkList);
+
+    if (LinkList->next != NULL)
+        _DIC_DestroyLinkList(Dict, LinkList->next);
+
+    // Links in the compact memory are freed with the dict
+    if (!LinkList->compact)
+        _DIC_FREE(Dict, LinkList);
+}
+
 DIC_Dict *DIC_CreateDict(size_t Size)
 {
+    return DIC_CreateDictEx(Size, NULL);
+}
+
+DIC_Dict *DIC_CreateDictEx(size_t Size, const DIC_Allocator *Allocator)
+{
+    // Get the allocator
+    DIC_Allocator UseAllocator;
+
+    if (Allocator != NULL)
+        UseAllocator = *Allocator;
+
+    else
+        DIC_InitAllocator(&UseAllocator);
+
     // Allocate memory
-    DIC_Dict *Dict = (DIC_Dict *)malloc(sizeof(DIC_Dict));
+    DIC_Dict *Dict = (DIC_Dict *)UseAllocator.alloc(UseAllocator.context, sizeof(DIC_Dict));
 
     if (Dict == NULL)
     {
-        _DIC_AddErrorForeign(_DIC_ERRORID_CREATEDIC_MALLOC, strerror(errno), _DIC_ERRORMES_MALLOC, sizeof(DIC_Dict));
+        _DIC_AddErrorForeign(_DIC_ERRORID_CREATEDIC_MALLOC, _DIC_ALLOCERROR(&UseAllocator), _DIC_ERRORMES_MALLOC, sizeof(DIC_Dict));
         return NULL;
     }
 
     // Initialize
     DIC_InitDict(Dict);
+    Dict->allocator = UseAllocator;
 
     // Get memory for the list
     Dict->length = Size;
-    Dict->list = (DIC_LinkList **)malloc(sizeof(DIC_LinkList *) * Size);
+    Dict->list = (DIC_LinkList **)_DIC_MALLOC(Dict, sizeof(DIC_LinkList *) * Size);
 
     if (Dict->list == NULL)
     {
-        _DIC_AddErrorForeign(_DIC_ERRORID_CREATEDIC_MALLOCLIST, strerror(errno), _DIC_ERRORMES_MALLOC, sizeof(DIC_LinkList *) * Size);
+        _DIC_AddErrorForeign(_DIC_ERRORID_CREATEDIC_MALLOCLIST, _DIC_ALLOCERROR(&Dict->allocator), _DIC_ERRORMES_MALLOC, sizeof(DIC_LinkList *) * Size);
         DIC_DestroyDict(Dict);
         return NULL;
     }
@@ -169,7 +1011,7 @@ DIC_Dict *DIC_CreateDict(size_t Size)
     return Dict;
 }
 
-bool DIC_AddItem(DIC_Dict *Dict, const char *Key, void *Value, size_t ValueLength, DIC_Mode Mode)
+bool _DIC_AddItem(DIC_Dict *Dict, const char *Key, void *Value, size_t ValueLength, DIC_Mode Mode)
 {
     extern HAS_Hash *_DIC_HashTable;
     extern size_t _DIC_DictCount;
@@ -197,16 +1039,25 @@ bool DIC_AddItem(DIC_Dict *Dict, const char *Key, void *Value, size_t ValueLengt
         ItemPos = &(*ItemPos)->next;
     }
 
+    // Make room in the log, a pointer replacing an owned value is logged as a removal since the pointer cannot be saved
+    bool LogItem = Dict->log.file != NULL && (Mode != DIC_MODE_POINTER || (*ItemPos != NULL && !(*ItemPos)->pointer));
+
+    if (LogItem && !_DIC_LogReserve(Dict, sizeof(uint8_t) + _DIC_EntrySize(KeyLength, ValueLength, Mode != DIC_MODE_POINTER)))
+    {
+        _DIC_AddError(_DIC_ERRORID_ADDITEM_LOG, _DIC_ERRORMES_WRITELOG);
+        return false;
+    }
+
     // Copy the value
     void *CopyValue = Value;
 
     if (Mode == DIC_MODE_COPY)
     {
-        CopyValue = malloc(ValueLength);
+        CopyValue = _DIC_MALLOC(Dict, ValueLength);
 
         if (CopyValue == NULL)
         {
-            _DIC_AddErrorForeign(_DIC_ERRORID_ADDITEM_MALLOCVALUE, strerror(errno), _DIC_ERRORMES_MALLOC, ValueLength);
+            _DIC_AddErrorForeign(_DIC_ERRORID_ADDITEM_MALLOCVALUE, _DIC_ALLOCERROR(&Dict->allocator), _DIC_ERRORMES_MALLOC, ValueLength);
             return false;
         }
 
@@ -217,26 +1068,26 @@ bool DIC_AddItem(DIC_Dict *Dict, const char *Key, void *Value, size_t ValueLengt
     if (*ItemPos == NULL)
     {
         // Copy the key
-        char *CopyKey = (char *)malloc(sizeof(char) * (KeyLength + 1));
+        char *CopyKey = (char *)_DIC_MALLOC(Dict, sizeof(char) * (KeyLength + 1));
 
         if (CopyKey == NULL)
         {
-            _DIC_AddErrorForeign(_DIC_ERRORID_ADDITEM_MALLOCKEY, strerror(errno), _DIC_ERRORMES_MALLOC, sizeof(char) * (KeyLength + 1));
+            _DIC_AddErrorForeign(_DIC_ERRORID_ADDITEM_MALLOCKEY, _DIC_ALLOCERROR(&Dict->allocator), _DIC_ERRORMES_MALLOC, sizeof(char) * (KeyLength + 1));
             if (Mode == DIC_MODE_COPY)
-                free(CopyValue);
+                _DIC_FREE(Dict, CopyValue);
             return false;
         }
 
         strcpy(CopyKey, Key);
 
-        DIC_LinkList *NewItem = (DIC_LinkList *)malloc(sizeof(DIC_LinkList));
+        DIC_LinkList *NewItem = (DIC_LinkList *)_DIC_MALLOC(Dict, sizeof(DIC_LinkList));
 
         if (NewItem == NULL)
         {
-            _DIC_AddErrorForeign(_DIC_ERRORID_ADDITEM_MALLOCITEM, strerror(errno), _DIC_ERRORMES_MALLOC, sizeof(DIC_LinkList));
-            free(CopyKey);
+            _DIC_AddErrorForeign(_DIC_ERRORID_ADDITEM_MALLOCITEM, _DIC_ALLOCERROR(&Dict->allocator), _DIC_ERRORMES_MALLOC, sizeof(DIC_LinkList));
+            _DIC_FREE(Dict, CopyKey);
             if (Mode == DIC_MODE_COPY)
-                free(CopyValue);
+                _DIC_FREE(Dict, CopyValue);
             return false;
         }
 
@@ -245,19 +1096,44 @@ bool DIC_AddItem(DIC_Dict *Dict, const char *Key, void *Value, size_t ValueLengt
         // Set values
         NewItem->key = CopyKey;
         *ItemPos = NewItem;
+        ++Dict->count;
+
+        if (Dict->filter.count > 0)
+            _DIC_FilterUpdate(&Dict->filter, HashKey, 1);
     }
 
-    // Remove old value
-    if (!(*ItemPos)->pointer && (*ItemPos)->value != NULL)
-        free((*ItemPos)->value);
+    // Remove old value, values in the compact memory are freed with the dict
+    if (!(*ItemPos)->pointer && !(*ItemPos)->compactValue && (*ItemPos)->value != NULL)
+        _DIC_FreeValue(Dict, *ItemPos);
 
     (*ItemPos)->value = CopyValue;
     (*ItemPos)->pointer = (Mode == DIC_MODE_POINTER);
+    (*ItemPos)->copy = (Mode == DIC_MODE_COPY);
+    (*ItemPos)->compactValue = false;
     (*ItemPos)->size = ValueLength;
 
+    if (LogItem && !_DIC_LogRecord(Dict, (Mode == DIC_MODE_POINTER) ? _DIC_LOGTYPE_REMOVE : _DIC_LOGTYPE_ADD, Key, KeyLength, Value, ValueLength))
+    {
+        _DIC_AddError(_DIC_ERRORID_ADDITEM_LOG, _DIC_ERRORMES_WRITELOG);
+        return false;
+    }
+
     return true;
 }
 
+bool DIC_AddItem(DIC_Dict *Dict, const char *Key, void *Value, size_t ValueLength, DIC_Mode Mode)
+{
+#ifdef DIC_LATENCY
+    uint64_t Start = _DIC_LatencyStart();
+    bool Result = _DIC_AddItem(Dict, Key, Value, ValueLength, Mode);
+    _DIC_LatencyStop(DIC_OPERATION_ADDITEM, Start, Dict, Key);
+
+    return Result;
+#else
+    return _DIC_AddItem(Dict, Key, Value, ValueLength, Mode);
+#endif
+}
+
 bool DIC_AddList(DIC_Dict *Dict, const char **Keys, size_t Count, void *Values, const size_t *ValueLengths, DIC_Mode Mode)
 {
     // Setup ValueLength if not needed
@@ -301,7 +1177,7 @@ bool DIC_AddList(DIC_Dict *Dict, const char **Keys, size_t Count, void *Values,
     return true;
 }
 
-void *DIC_GetItem(DIC_Dict *Dict, const char *Key)
+void *_DIC_GetItem(DIC_Dict *Dict, const char *Key)
 {
     extern HAS_Hash *_DIC_HashTable;
     extern size_t _DIC_DictCount;
@@ -316,6 +1192,13 @@ void *DIC_GetItem(DIC_Dict *Dict, const char *Key)
     size_t KeyLength = strlen(Key);
     uint64_t HashKey = HAS_HashValue(_DIC_HashTable, (uint8_t *)Key, KeyLength);
 
+    // Let the filter answer if it is missing
+    if (Dict->filter.count > 0 && !_DIC_FilterUpdate(&Dict->filter, HashKey, 0))
+    {
+        _DIC_SetError(_DIC_ERRORID_GETITEM_NOITEM, _DIC_ERRORMES_NOITEM);
+        return NULL;
+    }
+
     // Find the item
     DIC_LinkList **ItemPos = Dict->list + HashKey % Dict->length;
 
@@ -333,20 +1216,27 @@ void *DIC_GetItem(DIC_Dict *Dict, const char *Key)
     return NULL;
 }
 
-bool DIC_RemoveItem(DIC_Dict *Dict, const char *Key)
+void *DIC_GetItem(DIC_Dict *Dict, const char *Key)
 {
-    extern HAS_Hash *_DIC_HashTable;
-    extern size_t _DIC_DictCount;
+#ifdef DIC_LATENCY
+    uint64_t Start = _DIC_LatencyStart();
+    void *Value = _DIC_GetItem(Dict, Key);
+    _DIC_LatencyStop(DIC_OPERATION_GETITEM, Start, Dict, Key);
+
+    return Value;
+#else
+    return _DIC_GetItem(Dict, Key);
+#endif
+}
 
-    if (_DIC_HashTable == NULL)
-    {
-        _DIC_SetError(_DIC_ERRORID_REMOVEITEM_HASHTABLE, _DIC_ERRORMES_NOHASHTABLE, _DIC_DictCount);
-        return false;
-    }
+// Removes an item with an already hashed key, a missing item only sets Found to false and does not touch the error state
+bool _DIC_RemoveHashedItem(DIC_Dict *Dict, const char *Key, size_t KeyLength, uint64_t HashKey, bool *Found)
+{
+    *Found = false;
 
-    // Hash the key
-    size_t KeyLength = strlen(Key);
-    uint64_t HashKey = HAS_HashValue(_DIC_HashTable, (uint8_t *)Key, KeyLength);
+    // Let the filter answer if it is missing
+    if (Dict->filter.count > 0 && !_DIC_FilterUpdate(&Dict->filter, HashKey, 0))
+        return false;
 
     // Find the item
     DIC_LinkList **ItemPos = Dict->list + HashKey % Dict->length;
@@ -363,8 +1253,16 @@ bool DIC_RemoveItem(DIC_Dict *Dict, const char *Key)
 
     // Make sure that it found something
     if (*ItemPos == NULL)
+        return false;
+
+    *Found = true;
+
+    // Make room in the log, items with pointers are never saved
+    bool LogItem = Dict->log.file != NULL && !(*ItemPos)->pointer;
+
+    if (LogItem && !_DIC_LogReserve(Dict, sizeof(uint8_t) + _DIC_EntrySize(KeyLength, 0, false)))
     {
-        _DIC_SetError(_DIC_ERRORID_REMOVEITEM_NOITEM, _DIC_ERRORMES_NOITEM);
+        _DIC_AddError(_DIC_ERRORID_REMOVEITEM_LOG, _DIC_ERRORMES_WRITELOG);
         return false;
     }
 
@@ -372,13 +1270,74 @@ bool DIC_RemoveItem(DIC_Dict *Dict, const char *Key)
     DIC_LinkList *NextList = (*ItemPos)->next;
     (*ItemPos)->next = NULL;
 
-    DIC_DestroyLinkList(*ItemPos);
+    _DIC_DestroyLinkList(Dict, *ItemPos);
     *ItemPos = NextList;
+    --Dict->count;
+
+    if (Dict->filter.count > 0)
+        _DIC_FilterUpdate(&Dict->filter, HashKey, -1);
+
+    // Compact the dict if it has become too sparse, leave room such that the next removals do not compact it again
+    if (Dict->compactLoad > 0 && Dict->length > Dict->compactMin && (double)Dict->count < Dict->compactLoad * (double)Dict->length)
+    {
+        size_t Size = (size_t)((double)Dict->count / (2 * Dict->compactLoad) + 0.5);
+
+        if (Size < Dict->compactMin)
+            Size = Dict->compactMin;
+
+        if (!DIC_CompactDict(Dict, Size))
+            _DIC_AddError(_DIC_ERRORID_REMOVEITEM_COMPACT, _DIC_ERRORMES_COMPACTDICT);
+    }
+
+    // Log the removal
+    if (LogItem && !_DIC_LogRecord(Dict, _DIC_LOGTYPE_REMOVE, Key, KeyLength, NULL, 0))
+    {
+        _DIC_AddError(_DIC_ERRORID_REMOVEITEM_LOG, _DIC_ERRORMES_WRITELOG);
+        return false;
+    }
 
     return true;
 }
 
-bool DIC_CheckItem(DIC_Dict *Dict, const char *Key)
+bool _DIC_RemoveItem(DIC_Dict *Dict, const char *Key)
+{
+    extern HAS_Hash *_DIC_HashTable;
+    extern size_t _DIC_DictCount;
+
+    if (_DIC_HashTable == NULL)
+    {
+        _DIC_SetError(_DIC_ERRORID_REMOVEITEM_HASHTABLE, _DIC_ERRORMES_NOHASHTABLE, _DIC_DictCount);
+        return false;
+    }
+
+    // Hash the key
+    size_t KeyLength = strlen(Key);
+    uint64_t HashKey = HAS_HashValue(_DIC_HashTable, (uint8_t *)Key, KeyLength);
+    bool Found;
+
+    if (_DIC_RemoveHashedItem(Dict, Key, KeyLength, HashKey, &Found))
+        return true;
+
+    if (!Found)
+        _DIC_SetError(_DIC_ERRORID_REMOVEITEM_NOITEM, _DIC_ERRORMES_NOITEM);
+
+    return false;
+}
+
+bool DIC_RemoveItem(DIC_Dict *Dict, const char *Key)
+{
+#ifdef DIC_LATENCY
+    uint64_t Start = _DIC_LatencyStart();
+    bool Result = _DIC_RemoveItem(Dict, Key);
+    _DIC_LatencyStop(DIC_OPERATION_REMOVEITEM, Start, Dict, Key);
+
+    return Result;
+#else
+    return _DIC_RemoveItem(Dict, Key);
+#endif
+}
+
+bool _DIC_CheckItem(DIC_Dict *Dict, const char *Key)
 {
     extern HAS_Hash *_DIC_HashTable;
     extern size_t _DIC_DictCount;
@@ -393,6 +1352,10 @@ bool DIC_CheckItem(DIC_Dict *Dict, const char *Key)
     size_t KeyLength = strlen(Key);
     uint64_t HashKey = HAS_HashValue(_DIC_HashTable, (uint8_t *)Key, KeyLength);
 
+    // Let the filter answer if it is missing
+    if (Dict->filter.count > 0 && !_DIC_FilterUpdate(&Dict->filter, HashKey, 0))
+        return false;
+
     // Find the item
     DIC_LinkList **ItemPos = Dict->list + HashKey % Dict->length;
 
@@ -409,10 +1372,23 @@ bool DIC_CheckItem(DIC_Dict *Dict, const char *Key)
     return false;
 }
 
+bool DIC_CheckItem(DIC_Dict *Dict, const char *Key)
+{
+#ifdef DIC_LATENCY
+    uint64_t Start = _DIC_LatencyStart();
+    bool Result = _DIC_CheckItem(Dict, Key);
+    _DIC_LatencyStop(DIC_OPERATION_CHECKITEM, Start, Dict, Key);
+
+    return Result;
+#else
+    return _DIC_CheckItem(Dict, Key);
+#endif
+}
+
 DIC_Dict *DIC_CopyDict(DIC_Dict *Dict)
 {
     // Create a new dict
-    DIC_Dict *NewDict = DIC_CreateDict(Dict->length);
+    DIC_Dict *NewDict = DIC_CreateDictEx(Dict->length, &Dict->allocator);
 
     if (NewDict == NULL)
     {
@@ -425,11 +1401,11 @@ DIC_Dict *DIC_CopyDict(DIC_Dict *Dict)
         for (DIC_LinkList *SrcLink = *SrcList, **DstLink = DstList; SrcLink != NULL; SrcLink = SrcLink->next, DstLink = &(*DstLink)->next)
         {
             // Create new LinkList
-            DIC_LinkList *NewLink = (DIC_LinkList *)malloc(sizeof(DIC_LinkList));
+            DIC_LinkList *NewLink = (DIC_LinkList *)_DIC_MALLOC(NewDict, sizeof(DIC_LinkList));
 
             if (NewLink == NULL)
             {
-                _DIC_AddErrorForeign(_DIC_ERRORID_COPYDICT_MALLOCLINK, strerror(errno), _DIC_ERRORMES_MALLOC, sizeof(DIC_LinkList));
+                _DIC_AddErrorForeign(_DIC_ERRORID_COPYDICT_MALLOCLINK, _DIC_ALLOCERROR(&NewDict->allocator), _DIC_ERRORMES_MALLOC, sizeof(DIC_LinkList));
                 DIC_DestroyDict(NewDict);
                 return NULL;
             }
@@ -437,13 +1413,13 @@ DIC_Dict *DIC_CopyDict(DIC_Dict *Dict)
             DIC_InitLinkList(NewLink);
 
             // Copy key
-            NewLink->key = (char *)malloc(sizeof(char) * (strlen(SrcLink->key) + 1));
+            NewLink->key = (char *)_DIC_MALLOC(NewDict, sizeof(char) * (strlen(SrcLink->key) + 1));
 
             if (NewLink->key == NULL)
             {
-                _DIC_AddErrorForeign(_DIC_ERRORID_COPYDICT_MALLOCKEY, strerror(errno), _DIC_ERRORMES_MALLOC, sizeof(char) * (strlen(SrcLink->key) + 1));
+                _DIC_AddErrorForeign(_DIC_ERRORID_COPYDICT_MALLOCKEY, _DIC_ALLOCERROR(&NewDict->allocator), _DIC_ERRORMES_MALLOC, sizeof(char) * (strlen(SrcLink->key) + 1));
+                _DIC_DestroyLinkList(NewDict, NewLink);
                 DIC_DestroyDict(NewDict);
-                DIC_DestroyLinkList(NewLink);
                 return NULL;
             }
 
@@ -455,13 +1431,13 @@ DIC_Dict *DIC_CopyDict(DIC_Dict *Dict)
 
             else
             {
-                NewLink->value = malloc(SrcLink->size);
+                NewLink->value = _DIC_MALLOC(NewDict, SrcLink->size);
 
                 if (NewLink->value == NULL)
                 {
-                    _DIC_AddErrorForeign(_DIC_ERRORID_COPYDICT_MALLOCVALUE, strerror(errno), _DIC_ERRORMES_MALLOC, SrcLink->size);
+                    _DIC_AddErrorForeign(_DIC_ERRORID_COPYDICT_MALLOCVALUE, _DIC_ALLOCERROR(&NewDict->allocator), _DIC_ERRORMES_MALLOC, SrcLink->size);
+                    _DIC_DestroyLinkList(NewDict, NewLink);
                     DIC_DestroyDict(NewDict);
-                    DIC_DestroyLinkList(NewLink);
                     return NULL;
                 }
 
@@ -469,89 +1445,1223 @@ DIC_Dict *DIC_CopyDict(DIC_Dict *Dict)
             }
 
             NewLink->pointer = SrcLink->pointer;
+            NewLink->copy = !SrcLink->pointer;
             NewLink->size = SrcLink->size;
 
             // Add to dict
             *DstLink = NewLink;
+            ++NewDict->count;
+        }
+
+    NewDict->compactLoad = Dict->compactLoad;
+    NewDict->compactMin = Dict->compactMin;
+
+    // Copy the filter
+    if (Dict->filter.count > 0)
+    {
+        if (!_DIC_CreateFilter(NewDict, &NewDict->filter, Dict->filter.count))
+        {
+            _DIC_AddErrorForeign(_DIC_ERRORID_COPYDICT_MALLOCFILTER, _DIC_ALLOCERROR(&NewDict->allocator), _DIC_ERRORMES_MALLOC, DIC_CACHELINE * (Dict->filter.count + 1) - 1);
+            DIC_DestroyDict(NewDict);
+            return NULL;
         }
 
+        memcpy(NewDict->filter.counters, Dict->filter.counters, DIC_CACHELINE * Dict->filter.count);
+    }
+
     return NewDict;
 }
 
 size_t DIC_DictLength(DIC_Dict *Dict)
 {
-    size_t Length = 0;
+    return Dict->count;
+}
+
+bool DIC_CompactDict(DIC_Dict *Dict, size_t Size)
+{
+    extern HAS_Hash *_DIC_HashTable;
+    extern size_t _DIC_DictCount;
+
+    if (_DIC_HashTable == NULL)
+    {
+        _DIC_SetError(_DIC_ERRORID_COMPACTDICT_HASHTABLE, _DIC_ERRORMES_NOHASHTABLE, _DIC_DictCount);
+        return false;
+    }
+
+    // Fit the list to the number of elements
+    if (Size == 0)
+        Size = (Dict->count > 0) ? Dict->count : 1;
+
+    // Find the size of the compact memory, first the links, then the values and last the keys
+    size_t LinkSize = _DIC_ALIGNSIZE(sizeof(DIC_LinkList) * Dict->count);
+    size_t ValueSize = 0;
+    size_t KeySize = 0;
 
-    // Go through the entire dict
     for (DIC_LinkList **List = Dict->list, **EndList = Dict->list + Dict->length; List < EndList; ++List)
         for (DIC_LinkList *Link = *List; Link != NULL; Link = Link->next)
-            ++Length;
+        {
+            if (Link->copy)
+                ValueSize += _DIC_ALIGNSIZE(Link->size);
 
-    return Length;
+            KeySize += sizeof(char) * (strlen(Link->key) + 1);
+        }
+
+    // Get memory for the new list
+    DIC_LinkList **NewList = (DIC_LinkList **)_DIC_MALLOC(Dict, sizeof(DIC_LinkList *) * Size);
+
+    if (NewList == NULL)
+    {
+        _DIC_AddErrorForeign(_DIC_ERRORID_COMPACTDICT_MALLOCLIST, _DIC_ALLOCERROR(&Dict->allocator), _DIC_ERRORMES_MALLOC, sizeof(DIC_LinkList *) * Size);
+        return false;
+    }
+
+    for (DIC_LinkList **List = NewList, **EndList = NewList + Size; List < EndList; ++List)
+        *List = NULL;
+
+    // Get the compact memory
+    uint8_t *Memory = NULL;
+
+    if (Dict->count > 0)
+    {
+        Memory = (uint8_t *)_DIC_MALLOC(Dict, LinkSize + ValueSize + KeySize);
+
+        if (Memory == NULL)
+        {
+            _DIC_AddErrorForeign(_DIC_ERRORID_COMPACTDICT_MALLOCMEMORY, _DIC_ALLOCERROR(&Dict->allocator), _DIC_ERRORMES_MALLOC, LinkSize + ValueSize + KeySize);
+            _DIC_FREE(Dict, NewList);
+            return false;
+        }
+    }
+
+    // Move all of the links to the new list
+    for (DIC_LinkList **List = Dict->list, **EndList = Dict->list + Dict->length; List < EndList; ++List)
+        while (*List != NULL)
+        {
+            DIC_LinkList *Link = *List;
+            *List = Link->next;
+
+            uint64_t HashKey = HAS_HashValue(_DIC_HashTable, (uint8_t *)Link->key, strlen(Link->key));
+            DIC_LinkList **NewPos = NewList + HashKey % Size;
+
+            Link->next = *NewPos;
+            *NewPos = Link;
+        }
+
+    // Copy the links into the compact memory in the order they are found
+    DIC_LinkList *NewLink = (DIC_LinkList *)Memory;
+    uint8_t *NewValue = Memory + LinkSize;
+    char *NewKey = (char *)(Memory + LinkSize + ValueSize);
+
+    for (DIC_LinkList **List = NewList, **EndList = NewList + Size; List < EndList; ++List)
+        for (DIC_LinkList **Link = List; *Link != NULL; Link = &(*Link)->next, ++NewLink)
+        {
+            DIC_LinkList *OldLink = *Link;
+            *NewLink = *OldLink;
+            NewLink->compact = true;
+            NewLink->compactValue = OldLink->copy;
+
+            // Copy the key
+            strcpy(NewKey, OldLink->key);
+            NewLink->key = NewKey;
+            NewKey += strlen(OldLink->key) + 1;
+
+            // Copy the value
+            if (OldLink->copy)
+            {
+                memcpy(NewValue, OldLink->value, OldLink->size);
+                NewLink->value = NewValue;
+                NewValue += _DIC_ALIGNSIZE(OldLink->size);
+            }
+
+            *Link = NewLink;
+
+            // Free the old value, it may have been replaced after the last compaction
+            if (OldLink->copy && !OldLink->compactValue && OldLink->value != NULL)
+                _DIC_FREE(Dict, OldLink->value);
+
+            // Free the old link
+            if (!OldLink->compact)
+            {
+                _DIC_FREE(Dict, OldLink->key);
+                _DIC_FREE(Dict, OldLink);
+            }
+        }
+
+    // Replace the list and the compact memory
+    _DIC_FREE(Dict, Dict->list);
+
+    if (Dict->compact != NULL)
+        _DIC_FREE(Dict, Dict->compact);
+
+    Dict->list = NewList;
+    Dict->length = Size;
+    Dict->compact = Memory;
+
+    return true;
 }
 
-void DIC_InitLinkList(DIC_LinkList *Struct)
+void DIC_SetCompactPolicy(DIC_Dict *Dict, double MinLoad, size_t MinSize)
 {
-    Struct->key = NULL;
-    Struct->value = NULL;
-    Struct->size = 0;
-    Struct->pointer = true;
-    Struct->next = NULL;
+    // Above 0.5 the compacted dict would already be too sparse after the next removal
+    if (MinLoad > 0.5)
+        MinLoad = 0.5;
+
+    else if (MinLoad < 0)
+        MinLoad = 0;
+
+    Dict->compactLoad = MinLoad;
+    Dict->compactMin = (MinSize > 0) ? MinSize : Dict->length;
 }
 
-void DIC_InitDict(DIC_Dict *Struct)
+bool DIC_AttachFilter(DIC_Dict *Dict, size_t ExpectedCount)
 {
-    Struct->list = NULL;
-    Struct->length = 0;
+    extern HAS_Hash *_DIC_HashTable;
+    extern size_t _DIC_DictCount;
+
+    if (_DIC_HashTable == NULL)
+    {
+        _DIC_SetError(_DIC_ERRORID_ATTACHFILTER_HASHTABLE, _DIC_ERRORMES_NOHASHTABLE, _DIC_DictCount);
+        return false;
+    }
+
+    // Find the number of blocks
+    if (ExpectedCount < Dict->count)
+        ExpectedCount = Dict->count;
+
+    size_t Count = (ExpectedCount * _DIC_FILTERCOUNTERS + 2 * DIC_CACHELINE - 1) / (2 * DIC_CACHELINE);
+
+    if (Count == 0)
+        Count = 1;
+
+    // Create the filter
+    DIC_Filter Filter;
+
+    if (!_DIC_CreateFilter(Dict, &Filter, Count))
+    {
+        _DIC_AddErrorForeign(_DIC_ERRORID_ATTACHFILTER_MALLOC, _DIC_ALLOCERROR(&Dict->allocator), _DIC_ERRORMES_MALLOC, DIC_CACHELINE * (Count + 1) - 1);
+        return false;
+    }
+
+    // Add all of the current items
+    for (DIC_LinkList **List = Dict->list, **EndList = Dict->list + Dict->length; List < EndList; ++List)
+        for (DIC_LinkList *Link = *List; Link != NULL; Link = Link->next)
+            _DIC_FilterUpdate(&Filter, HAS_HashValue(_DIC_HashTable, (uint8_t *)Link->key, strlen(Link->key)), 1);
+
+    // Replace the old filter
+    DIC_DetachFilter(Dict);
+    Dict->filter = Filter;
+
+    return true;
 }
 
-void DIC_DestroyLinkList(DIC_LinkList *LinkList)
+void DIC_DetachFilter(DIC_Dict *Dict)
 {
-    // Destroy the key
-    if (LinkList->key != NULL)
-        free(LinkList->key);
+    if (Dict->filter.memory != NULL)
+        _DIC_FREE(Dict, Dict->filter.memory);
+
+    DIC_InitFilter(&Dict->filter);
+}
+
+// Waits for the entries of the directory holding a file to reach the disk, the path is cut to the directory
+bool _DIC_SyncDirectory(char *Path)
+{
+    char *Slash = strrchr(Path, '/');
 
-    if (!LinkList->pointer && LinkList->value != NULL)
-        free(LinkList->value);
+    // Keep the slash for files in the root directory
+    if (Slash != NULL)
+        Slash[(Slash == Path) ? 1 : 0] = '\0';
 
-    if (LinkList->next != NULL)
-        DIC_DestroyLinkList(LinkList->next);
+    int Directory = open((Slash != NULL) ? Path : ".", O_RDONLY | O_DIRECTORY);
 
-    free(LinkList);
+    if (Directory < 0)
+        return false;
+
+    bool Success = fsync(Directory) == 0;
+    Success = (close(Directory) == 0) && Success;
+
+    return Success;
 }
 
-void DIC_DestroyDict(DIC_Dict *Dict)
+bool DIC_SaveDict(DIC_Dict *Dict, const char *Path)
 {
-    // Destroy the dict
-    if (Dict->list != NULL)
+    // Write to a temporary file first such that the old snapshot survives a crash
+    size_t PathLength = strlen(Path);
+    char *TempPath = (char *)_DIC_MALLOC(Dict, sizeof(char) * (PathLength + 5));
+
+    if (TempPath == NULL)
     {
-        for (DIC_LinkList **List = Dict->list, **EndList = Dict->list + Dict->length; List < EndList; ++List)
-            if (*List != NULL)
-                DIC_DestroyLinkList(*List);
+        _DIC_AddErrorForeign(_DIC_ERRORID_SAVEDICT_MALLOC, _DIC_ALLOCERROR(&Dict->allocator), _DIC_ERRORMES_MALLOC, sizeof(char) * (PathLength + 5));
+        return false;
+    }
+
+    strcpy(TempPath, Path);
+    strcpy(TempPath + PathLength, ".tmp");
 
-        free(Dict->list);
+    FILE *File = fopen(TempPath, "wb");
+
+    if (File == NULL)
+    {
+        _DIC_AddErrorForeign(_DIC_ERRORID_SAVEDICT_OPEN, strerror(errno), _DIC_ERRORMES_OPENFILE, TempPath);
+        _DIC_FREE(Dict, TempPath);
+        return false;
     }
 
-    free(Dict);
+    // Count the items with values owned by the dict
+    uint64_t Count = 0;
 
-    // Destroy the hash if needed
-    extern HAS_Hash *_DIC_HashTable;
-    extern size_t _DIC_DictCount;
+    for (DIC_LinkList **List = Dict->list, **EndList = Dict->list + Dict->length; List < EndList; ++List)
+        for (DIC_LinkList *Link = *List; Link != NULL; Link = Link->next)
+            if (!Link->pointer)
+                ++Count;
 
-    if (_DIC_DictCount == 0)
+    // Write the header
+    uint64_t Length = Dict->length;
+    bool Success = fwrite(_DIC_SNAPSHOTHEADER, sizeof(char), _DIC_HEADERSIZE, File) == _DIC_HEADERSIZE && fwrite(&Length, sizeof(uint64_t), 1, File) == 1 && fwrite(&Count, sizeof(uint64_t), 1, File) == 1;
+
+    // Write the items
+    for (DIC_LinkList **List = Dict->list, **EndList = Dict->list + Dict->length; List < EndList && Success; ++List)
+        for (DIC_LinkList *Link = *List; Link != NULL && Success; Link = Link->next)
+            if (!Link->pointer)
+                Success = _DIC_WriteEntry(File, Link->key, strlen(Link->key), Link->value, Link->size);
+
+    // Write the filter
+    uint64_t FilterCount = Dict->filter.count;
+    uint64_t LineSize = DIC_CACHELINE;
+
+    Success = Success && fwrite(&FilterCount, sizeof(uint64_t), 1, File) == 1 && fwrite(&LineSize, sizeof(uint64_t), 1, File) == 1 && (FilterCount == 0 || fwrite(Dict->filter.counters, DIC_CACHELINE, FilterCount, File) == FilterCount);
+
+    // Make sure it has reached the disk
+    Success = Success && fflush(File) == 0 && fsync(fileno(File)) == 0;
+    Success = (fclose(File) == 0) && Success;
+
+    if (!Success)
     {
-        _DIC_SetError(_DIC_ERRORID_DESTROYDICT_NODICT, _DIC_ERRORMES_WRONGDICTCOUNT);
-        return;
+        _DIC_AddErrorForeign(_DIC_ERRORID_SAVEDICT_WRITE, strerror(errno), _DIC_ERRORMES_WRITEFILE, TempPath);
+        remove(TempPath);
+        _DIC_FREE(Dict, TempPath);
+        return false;
     }
 
-    --_DIC_DictCount;
+    // Replace the old snapshot
+    if (rename(TempPath, Path) != 0)
+    {
+        _DIC_AddErrorForeign(_DIC_ERRORID_SAVEDICT_RENAME, strerror(errno), _DIC_ERRORMES_RENAMEFILE, TempPath, Path);
+        remove(TempPath);
+        _DIC_FREE(Dict, TempPath);
+        return false;
+    }
 
-    // Destroy hash
-    if (_DIC_DictCount == 0 && _DIC_HashTable != NULL)
+    // Sync the directory such that the rename itself survives a crash
+    strcpy(TempPath, Path);
+
+    if (!_DIC_SyncDirectory(TempPath))
     {
-        HAS_DestroyHash(_DIC_HashTable);
-        _DIC_HashTable = NULL;
+        _DIC_AddErrorForeign(_DIC_ERRORID_SAVEDICT_SYNCDIR, strerror(errno), _DIC_ERRORMES_SYNCDIR, Path);
+        _DIC_FREE(Dict, TempPath);
+        return false;
+    }
+
+    _DIC_FREE(Dict, TempPath);
+
+    return true;
+}
+
+// Reads a snapshot from an open file
+DIC_Dict *_DIC_ReadSnapshot(FILE *File, const char *Path, const DIC_Allocator *Allocator)
+{
+    // Read the header
+    char Header[_DIC_HEADERSIZE];
+    uint64_t Length;
+    uint64_t Count;
+
+    if (fread(Header, sizeof(char), _DIC_HEADERSIZE, File) != _DIC_HEADERSIZE || memcmp(Header, _DIC_SNAPSHOTHEADER, _DIC_HEADERSIZE) != 0 || fread(&Length, sizeof(uint64_t), 1, File) != 1 || fread(&Count, sizeof(uint64_t), 1, File) != 1 || Length == 0)
+    {
+        _DIC_SetError(_DIC_ERRORID_LOADDICT_FORMAT, _DIC_ERRORMES_FILEFORMAT, Path);
+        return NULL;
+    }
+
+    DIC_Dict *Dict = DIC_CreateDictEx(Length, Allocator);
+
+    if (Dict == NULL)
+    {
+        _DIC_AddError(_DIC_ERRORID_LOADDICT_CREATE, _DIC_ERRORMES_CREATEDICT);
+        return NULL;
+    }
+
+    // Read the items
+    uint8_t *Buffer = NULL;
+    size_t BufferSize = 0;
+
+    for (uint64_t Item = 0; Item < Count; ++Item)
+    {
+        size_t ValueLength;
+        bool OutOfMemory;
+
+        if (!_DIC_ReadEntry(Dict, File, true, &Buffer, &BufferSize, &ValueLength, &OutOfMemory))
+        {
+            if (OutOfMemory)
+                _DIC_AddError(_DIC_ERRORID_LOADDICT_MALLOC, _DIC_ERRORMES_LOADDICT);
+
+            else
+                _DIC_SetError(_DIC_ERRORID_LOADDICT_READ, _DIC_ERRORMES_READFILE, Path);
+
+            if (Buffer != NULL)
+                _DIC_FREE(Dict, Buffer);
+
+            DIC_DestroyDict(Dict);
+            return NULL;
+        }
+
+        if (!DIC_AddItem(Dict, (char *)Buffer, Buffer + strlen((char *)Buffer) + 1, ValueLength, DIC_MODE_COPY))
+        {
+            _DIC_AddError(_DIC_ERRORID_LOADDICT_ADDITEM, _DIC_ERRORMES_ADDITEM);
+            _DIC_FREE(Dict, Buffer);
+            DIC_DestroyDict(Dict);
+            return NULL;
+        }
+    }
+
+    if (Buffer != NULL)
+        _DIC_FREE(Dict, Buffer);
+
+    // Read the filter
+    uint64_t FilterCount;
+    uint64_t LineSize;
+
+    if (fread(&FilterCount, sizeof(uint64_t), 1, File) != 1 || fread(&LineSize, sizeof(uint64_t), 1, File) != 1)
+    {
+        _DIC_SetError(_DIC_ERRORID_LOADDICT_READ, _DIC_ERRORMES_READFILE, Path);
+        DIC_DestroyDict(Dict);
+        return NULL;
     }
+
+    if (FilterCount == 0)
+        return Dict;
+
+    // The counters can only be reused if they were made for the same cache line size
+    if (LineSize != DIC_CACHELINE)
+    {
+        if (!DIC_AttachFilter(Dict, 0))
+        {
+            _DIC_AddError(_DIC_ERRORID_LOADDICT_FILTER, _DIC_ERRORMES_ATTACHFILTER);
+            DIC_DestroyDict(Dict);
+            return NULL;
+        }
+
+        return Dict;
+    }
+
+    if (!_DIC_CreateFilter(Dict, &Dict->filter, FilterCount))
+    {
+        _DIC_AddErrorForeign(_DIC_ERRORID_LOADDICT_FILTER, _DIC_ALLOCERROR(&Dict->allocator), _DIC_ERRORMES_MALLOC, DIC_CACHELINE * (FilterCount + 1) - 1);
+        DIC_DestroyDict(Dict);
+        return NULL;
+    }
+
+    if (fread(Dict->filter.counters, DIC_CACHELINE, FilterCount, File) != FilterCount)
+    {
+        _DIC_SetError(_DIC_ERRORID_LOADDICT_READ, _DIC_ERRORMES_READFILE, Path);
+        DIC_DestroyDict(Dict);
+        return NULL;
+    }
+
+    return Dict;
+}
+
+DIC_Dict *DIC_LoadDict(const char *Path, const DIC_Allocator *Allocator)
+{
+    FILE *File = fopen(Path, "rb");
+
+    if (File == NULL)
+    {
+        _DIC_AddErrorForeign(_DIC_ERRORID_LOADDICT_OPEN, strerror(errno), _DIC_ERRORMES_OPENFILE, Path);
+        return NULL;
+    }
+
+    DIC_Dict *Dict = _DIC_ReadSnapshot(File, Path, Allocator);
+    fclose(File);
+
+    return Dict;
+}
+
+bool DIC_OpenLog(DIC_Dict *Dict, const char *Path, size_t Batch)
+{
+    if (Dict->log.file != NULL)
+    {
+        _DIC_SetError(_DIC_ERRORID_OPENLOG_ALREADYOPEN, _DIC_ERRORMES_LOGOPEN);
+        return false;
+    }
+
+    FILE *File = fopen(Path, "a+b");
+
+    if (File == NULL)
+    {
+        _DIC_AddErrorForeign(_DIC_ERRORID_OPENLOG_OPEN, strerror(errno), _DIC_ERRORMES_OPENFILE, Path);
+        return false;
+    }
+
+    // The records are already collected in the log buffer, without a stdio buffer a failed write cannot be flushed later
+    setvbuf(File, NULL, _IONBF, 0);
+
+    // Check the header of an existing log or write a new one
+    fseek(File, 0, SEEK_END);
+
+    if (ftell(File) > 0)
+    {
+        char Header[_DIC_HEADERSIZE];
+        rewind(File);
+
+        if (fread(Header, sizeof(char), _DIC_HEADERSIZE, File) != _DIC_HEADERSIZE || memcmp(Header, _DIC_LOGHEADER, _DIC_HEADERSIZE) != 0)
+        {
+            _DIC_SetError(_DIC_ERRORID_OPENLOG_FORMAT, _DIC_ERRORMES_FILEFORMAT, Path);
+            fclose(File);
+            return false;
+        }
+
+        fseek(File, 0, SEEK_END);
+    }
+
+    else if (fwrite(_DIC_LOGHEADER, sizeof(char), _DIC_HEADERSIZE, File) != _DIC_HEADERSIZE || fflush(File) != 0)
+    {
+        _DIC_AddErrorForeign(_DIC_ERRORID_OPENLOG_WRITE, strerror(errno), _DIC_ERRORMES_WRITEFILE, Path);
+        fclose(File);
+        return false;
+    }
+
+    Dict->log.file = File;
+    Dict->log.batch = Batch;
+    Dict->log.committed = ftello(File);
+
+    return true;
+}
+
+bool DIC_CommitLog(DIC_Dict *Dict)
+{
+    if (Dict->log.file == NULL)
+    {
+        _DIC_SetError(_DIC_ERRORID_COMMITLOG_NOLOG, _DIC_ERRORMES_NOLOG);
+        return false;
+    }
+
+    int Descriptor = fileno(Dict->log.file);
+
+    // Remove the part of an earlier failed commit which did reach the file, the records are appended so they follow the last commit again
+    if (Dict->log.torn)
+    {
+        if (ftruncate(Descriptor, Dict->log.committed) != 0)
+        {
+            _DIC_AddErrorForeign(_DIC_ERRORID_COMMITLOG_WRITE, strerror(errno), _DIC_ERRORMES_TRUNCATEFILE);
+            return false;
+        }
+
+        Dict->log.torn = false;
+    }
+
+    // Write all of the records at once and wait for the disk
+    if ((Dict->log.used > 0 && fwrite(Dict->log.buffer, 1, Dict->log.used, Dict->log.file) != Dict->log.used) || fflush(Dict->log.file) != 0 || fsync(Descriptor) != 0)
+    {
+        _DIC_AddErrorForeign(_DIC_ERRORID_COMMITLOG_WRITE, strerror(errno), _DIC_ERRORMES_WRITELOG);
+
+        // Cut the log back right away such that a crash before the retry does not leave a torn record in the middle
+        clearerr(Dict->log.file);
+        Dict->log.torn = ftruncate(Descriptor, Dict->log.committed) != 0 || fsync(Descriptor) != 0;
+
+        return false;
+    }
+
+    Dict->log.committed += Dict->log.used;
+    Dict->log.used = 0;
+    Dict->log.records = 0;
+
+    return true;
+}
+
+bool DIC_CloseLog(DIC_Dict *Dict)
+{
+    bool Success = DIC_CommitLog(Dict);
+
+    if (!Success)
+        _DIC_AddError(_DIC_ERRORID_CLOSELOG_COMMIT, _DIC_ERRORMES_WRITELOG);
+
+    if (Dict->log.file != NULL)
+        fclose(Dict->log.file);
+
+    if (Dict->log.buffer != NULL)
+        _DIC_FREE(Dict, Dict->log.buffer);
+
+    DIC_InitLog(&Dict->log);
+
+    return Success;
+}
+
+bool DIC_CompactLog(DIC_Dict *Dict, const char *SnapshotPath)
+{
+    if (Dict->log.file == NULL)
+    {
+        _DIC_SetError(_DIC_ERRORID_COMPACTLOG_NOLOG, _DIC_ERRORMES_NOLOG);
+        return false;
+    }
+
+    // Write the log first, replaying it over the new snapshot gives the same dict if the log is never emptied
+    if (!DIC_CommitLog(Dict))
+    {
+        _DIC_AddError(_DIC_ERRORID_COMPACTLOG_COMMIT, _DIC_ERRORMES_WRITELOG);
+        return false;
+    }
+
+    if (!DIC_SaveDict(Dict, SnapshotPath))
+    {
+        _DIC_AddError(_DIC_ERRORID_COMPACTLOG_SAVE, _DIC_ERRORMES_SAVEDICT);
+        return false;
+    }
+
+    // Empty the log only after the snapshot is safe, new records are still appended after the header
+    if (ftruncate(fileno(Dict->log.file), _DIC_HEADERSIZE) != 0)
+    {
+        _DIC_AddErrorForeign(_DIC_ERRORID_COMPACTLOG_TRUNCATE, strerror(errno), _DIC_ERRORMES_TRUNCATEFILE);
+        return false;
+    }
+
+    Dict->log.committed = _DIC_HEADERSIZE;
+
+    return true;
+}
+
+DIC_Dict *DIC_RecoverDict(const char *SnapshotPath, const char *LogPath, size_t Size, const DIC_Allocator *Allocator)
+{
+    // Load the snapshot
+    DIC_Dict *Dict;
+    FILE *File = fopen(SnapshotPath, "rb");
+
+    if (File != NULL)
+    {
+        Dict = _DIC_ReadSnapshot(File, SnapshotPath, Allocator);
+        fclose(File);
+
+        if (Dict == NULL)
+        {
+            _DIC_AddError(_DIC_ERRORID_RECOVERDICT_LOAD, _DIC_ERRORMES_LOADDICT);
+            return NULL;
+        }
+    }
+
+    else if (errno == ENOENT)
+    {
+        Dict = DIC_CreateDictEx(Size, Allocator);
+
+        if (Dict == NULL)
+        {
+            _DIC_AddError(_DIC_ERRORID_RECOVERDICT_CREATE, _DIC_ERRORMES_CREATEDICT);
+            return NULL;
+        }
+    }
+
+    else
+    {
+        _DIC_AddErrorForeign(_DIC_ERRORID_RECOVERDICT_OPEN, strerror(errno), _DIC_ERRORMES_OPENFILE, SnapshotPath);
+        return NULL;
+    }
+
+    // Open the log, it is written to if a partial record must be cut off
+    File = fopen(LogPath, "r+b");
+
+    if (File == NULL)
+    {
+        if (errno == ENOENT)
+            return Dict;
+
+        _DIC_AddErrorForeign(_DIC_ERRORID_RECOVERDICT_OPEN, strerror(errno), _DIC_ERRORMES_OPENFILE, LogPath);
+        DIC_DestroyDict(Dict);
+        return NULL;
+    }
+
+    // An empty log may be left from a crash while creating it
+    char Header[_DIC_HEADERSIZE];
+    size_t HeaderSize = fread(Header, sizeof(char), _DIC_HEADERSIZE, File);
+
+    if (HeaderSize != 0 && (HeaderSize != _DIC_HEADERSIZE || memcmp(Header, _DIC_LOGHEADER, _DIC_HEADERSIZE) != 0))
+    {
+        _DIC_SetError(_DIC_ERRORID_RECOVERDICT_FORMAT, _DIC_ERRORMES_FILEFORMAT, LogPath);
+        fclose(File);
+        DIC_DestroyDict(Dict);
+        return NULL;
+    }
+
+    // Replay the records
+    uint8_t *Buffer = NULL;
+    size_t BufferSize = 0;
+    uint8_t Type;
+    off_t RecordEnd = ftello(File);
+    bool Partial = false;
+
+    while (fread(&Type, sizeof(uint8_t), 1, File) == 1)
+    {
+        if (Type != _DIC_LOGTYPE_ADD && Type != _DIC_LOGTYPE_REMOVE)
+        {
+            _DIC_SetError(_DIC_ERRORID_RECOVERDICT_FORMAT, _DIC_ERRORMES_FILEFORMAT, LogPath);
+
+            if (Buffer != NULL)
+                _DIC_FREE(Dict, Buffer);
+
+            fclose(File);
+            DIC_DestroyDict(Dict);
+            return NULL;
+        }
+
+        size_t ValueLength;
+        bool OutOfMemory;
+
+        if (!_DIC_ReadEntry(Dict, File, Type == _DIC_LOGTYPE_ADD, &Buffer, &BufferSize, &ValueLength, &OutOfMemory))
+        {
+            // A partial record at the end is left from a crash while writing the log
+            if (!OutOfMemory)
+            {
+                Partial = true;
+                break;
+            }
+
+            _DIC_AddError(_DIC_ERRORID_RECOVERDICT_MALLOC, _DIC_ERRORMES_LOADDICT);
+
+            if (Buffer != NULL)
+                _DIC_FREE(Dict, Buffer);
+
+            fclose(File);
+            DIC_DestroyDict(Dict);
+            return NULL;
+        }
+
+        // The item may already be missing if the log was not emptied after saving the snapshot
+        if (Type == _DIC_LOGTYPE_REMOVE)
+            DIC_RemoveItem(Dict, (char *)Buffer);
+
+        else if (!DIC_AddItem(Dict, (char *)Buffer, Buffer + strlen((char *)Buffer) + 1, ValueLength, DIC_MODE_COPY))
+        {
+            _DIC_AddError(_DIC_ERRORID_RECOVERDICT_ADDITEM, _DIC_ERRORMES_ADDITEM);
+            _DIC_FREE(Dict, Buffer);
+            fclose(File);
+            DIC_DestroyDict(Dict);
+            return NULL;
+        }
+
+        RecordEnd = ftello(File);
+    }
+
+    if (Buffer != NULL)
+        _DIC_FREE(Dict, Buffer);
+
+    // Cut off the partial record, otherwise it would swallow the first records appended when the log is opened again
+    if (Partial && (ftruncate(fileno(File), RecordEnd) != 0 || fsync(fileno(File)) != 0))
+    {
+        _DIC_AddErrorForeign(_DIC_ERRORID_RECOVERDICT_TRUNCATE, strerror(errno), _DIC_ERRORMES_TRUNCATEFILE);
+        fclose(File);
+        DIC_DestroyDict(Dict);
+        return NULL;
+    }
+
+    fclose(File);
+
+    return Dict;
+}
+
+DIC_ShardedDict *DIC_CreateShardedDict(size_t ShardCount, size_t Size, const DIC_Allocator *Allocator)
+{
+    if (ShardCount == 0)
+    {
+        _DIC_SetError(_DIC_ERRORID_CREATESHARDEDDICT_NOSHARDS, _DIC_ERRORMES_NOSHARDS);
+        return NULL;
+    }
+
+    // Get the allocator
+    DIC_Allocator UseAllocator;
+
+    if (Allocator != NULL)
+        UseAllocator = *Allocator;
+
+    else
+        DIC_InitAllocator(&UseAllocator);
+
+    // Allocate memory
+    DIC_ShardedDict *Dict = (DIC_ShardedDict *)UseAllocator.alloc(UseAllocator.context, sizeof(DIC_ShardedDict));
+
+    if (Dict == NULL)
+    {
+        _DIC_AddErrorForeign(_DIC_ERRORID_CREATESHARDEDDICT_MALLOC, _DIC_ALLOCERROR(&UseAllocator), _DIC_ERRORMES_MALLOC, sizeof(DIC_ShardedDict));
+        return NULL;
+    }
+
+    // Initialize
+    DIC_InitShardedDict(Dict);
+    Dict->allocator = UseAllocator;
+
+    // Get memory for the shards with room to align them to a cache line
+    Dict->memory = _DIC_MALLOC(Dict, sizeof(DIC_Shard) * ShardCount + DIC_CACHELINE - 1);
+
+    if (Dict->memory == NULL)
+    {
+        _DIC_AddErrorForeign(_DIC_ERRORID_CREATESHARDEDDICT_MALLOCSHARDS, _DIC_ALLOCERROR(&Dict->allocator), _DIC_ERRORMES_MALLOC, sizeof(DIC_Shard) * ShardCount + DIC_CACHELINE - 1);
+        DIC_DestroyShardedDict(Dict);
+        return NULL;
+    }
+
+    Dict->shards = (DIC_Shard *)(((uintptr_t)Dict->memory + DIC_CACHELINE - 1) / DIC_CACHELINE * DIC_CACHELINE);
+
+    // Create the shards, count is kept at the number of finished shards such that they can be destroyed on failure
+    size_t ShardSize = (Size + ShardCount - 1) / ShardCount;
+
+    if (ShardSize == 0)
+        ShardSize = 1;
+
+    for (DIC_Shard *Shard = Dict->shards, *EndShard = Dict->shards + ShardCount; Shard < EndShard; ++Shard)
+    {
+        Shard->dict = DIC_CreateDictEx(ShardSize, &Dict->allocator);
+
+        if (Shard->dict == NULL)
+        {
+            _DIC_AddError(_DIC_ERRORID_CREATESHARDEDDICT_CREATEDICT, _DIC_ERRORMES_CREATEDICT);
+            DIC_DestroyShardedDict(Dict);
+            return NULL;
+        }
+
+        int Error = pthread_mutex_init(&Shard->lock, NULL);
+
+        if (Error != 0)
+        {
+            _DIC_AddErrorForeign(_DIC_ERRORID_CREATESHARDEDDICT_LOCK, strerror(Error), _DIC_ERRORMES_CREATELOCK, (uint64_t)(Shard - Dict->shards));
+            DIC_DestroyDict(Shard->dict);
+            DIC_DestroyShardedDict(Dict);
+            return NULL;
+        }
+
+        ++Dict->count;
+    }
+
+    return Dict;
+}
+
+// Finds the shard to use for a key, the hash table must exist
+DIC_Shard *_DIC_GetShard(DIC_ShardedDict *Dict, const char *Key, size_t KeyLength, uint64_t *HashKey)
+{
+    extern HAS_Hash *_DIC_HashTable;
+
+    *HashKey = HAS_HashValue(_DIC_HashTable, (uint8_t *)Key, KeyLength);
+
+    // The low bits are used for the position in the dict list
+    return Dict->shards + (*HashKey >> 32) % Dict->count;
+}
+
+// Finds the link of a key without touching the error state, returns NULL if it is missing
+DIC_LinkList *_DIC_FindItem(DIC_Dict *Dict, const char *Key, uint64_t HashKey)
+{
+    if (Dict->filter.count > 0 && !_DIC_FilterUpdate(&Dict->filter, HashKey, 0))
+        return NULL;
+
+    for (DIC_LinkList *Link = Dict->list[HashKey % Dict->length]; Link != NULL; Link = Link->next)
+        if (strcmp(Link->key, Key) == 0)
+            return Link;
+
+    return NULL;
+}
+
+bool DIC_ShardedAddItem(DIC_ShardedDict *Dict, const char *Key, void *Value, size_t ValueLength, DIC_Mode Mode)
+{
+    extern HAS_Hash *_DIC_HashTable;
+    extern size_t _DIC_DictCount;
+
+    if (_DIC_HashTable == NULL)
+    {
+        _DIC_SetError(_DIC_ERRORID_SHARDEDADDITEM_HASHTABLE, _DIC_ERRORMES_NOHASHTABLE, _DIC_DictCount);
+        return false;
+    }
+
+    uint64_t HashKey;
+    DIC_Shard *Shard = _DIC_GetShard(Dict, Key, strlen(Key), &HashKey);
+
+    pthread_mutex_lock(&Shard->lock);
+    bool Result = DIC_AddItem(Shard->dict, Key, Value, ValueLength, Mode);
+    pthread_mutex_unlock(&Shard->lock);
+
+    if (!Result)
+        _DIC_AddError(_DIC_ERRORID_SHARDEDADDITEM_ADDITEM, _DIC_ERRORMES_ADDITEM);
+
+    return Result;
+}
+
+bool DIC_ShardedRemoveItem(DIC_ShardedDict *Dict, const char *Key)
+{
+    extern HAS_Hash *_DIC_HashTable;
+    extern size_t _DIC_DictCount;
+
+    if (_DIC_HashTable == NULL)
+    {
+        _DIC_SetError(_DIC_ERRORID_SHARDEDREMOVEITEM_HASHTABLE, _DIC_ERRORMES_NOHASHTABLE, _DIC_DictCount);
+        return false;
+    }
+
+    size_t KeyLength = strlen(Key);
+    uint64_t HashKey;
+    DIC_Shard *Shard = _DIC_GetShard(Dict, Key, KeyLength, &HashKey);
+    bool Found;
+
+    // A missing item is not an error here such that misses on different threads do not share the error state
+    pthread_mutex_lock(&Shard->lock);
+#ifdef DIC_LATENCY
+    uint64_t Start = _DIC_LatencyStart();
+    bool Result = _DIC_RemoveHashedItem(Shard->dict, Key, KeyLength, HashKey, &Found);
+    _DIC_LatencyStop(DIC_OPERATION_REMOVEITEM, Start, Shard->dict, Key);
+#else
+    bool Result = _DIC_RemoveHashedItem(Shard->dict, Key, KeyLength, HashKey, &Found);
+#endif
+    pthread_mutex_unlock(&Shard->lock);
+
+    if (!Result && Found)
+        _DIC_AddError(_DIC_ERRORID_SHARDEDREMOVEITEM_REMOVEITEM, _DIC_ERRORMES_REMOVEITEM);
+
+    return Result;
+}
+
+void *DIC_ShardedGetItem(DIC_ShardedDict *Dict, const char *Key)
+{
+    extern HAS_Hash *_DIC_HashTable;
+    extern size_t _DIC_DictCount;
+
+    if (_DIC_HashTable == NULL)
+    {
+        _DIC_SetError(_DIC_ERRORID_SHARDEDGETITEM_HASHTABLE, _DIC_ERRORMES_NOHASHTABLE, _DIC_DictCount);
+        return NULL;
+    }
+
+    uint64_t HashKey;
+    DIC_Shard *Shard = _DIC_GetShard(Dict, Key, strlen(Key), &HashKey);
+
+    // A missing item is not an error here such that misses on different threads do not share the error state
+    pthread_mutex_lock(&Shard->lock);
+#ifdef DIC_LATENCY
+    uint64_t Start = _DIC_LatencyStart();
+    DIC_LinkList *Link = _DIC_FindItem(Shard->dict, Key, HashKey);
+    _DIC_LatencyStop(DIC_OPERATION_GETITEM, Start, Shard->dict, Key);
+#else
+    DIC_LinkList *Link = _DIC_FindItem(Shard->dict, Key, HashKey);
+#endif
+    void *Value = (Link != NULL) ? Link->value : NULL;
+    pthread_mutex_unlock(&Shard->lock);
+
+    return Value;
+}
+
+bool DIC_ShardedCheckItem(DIC_ShardedDict *Dict, const char *Key)
+{
+    extern HAS_Hash *_DIC_HashTable;
+    extern size_t _DIC_DictCount;
+
+    if (_DIC_HashTable == NULL)
+    {
+        _DIC_SetError(_DIC_ERRORID_SHARDEDCHECKITEM_HASHTABLE, _DIC_ERRORMES_NOHASHTABLE, _DIC_DictCount);
+        return false;
+    }
+
+    uint64_t HashKey;
+    DIC_Shard *Shard = _DIC_GetShard(Dict, Key, strlen(Key), &HashKey);
+
+    pthread_mutex_lock(&Shard->lock);
+#ifdef DIC_LATENCY
+    uint64_t Start = _DIC_LatencyStart();
+    bool Result = (_DIC_FindItem(Shard->dict, Key, HashKey) != NULL);
+    _DIC_LatencyStop(DIC_OPERATION_CHECKITEM, Start, Shard->dict, Key);
+#else
+    bool Result = (_DIC_FindItem(Shard->dict, Key, HashKey) != NULL);
+#endif
+    pthread_mutex_unlock(&Shard->lock);
+
+    return Result;
+}
+
+size_t DIC_ShardedDictLength(DIC_ShardedDict *Dict)
+{
+    size_t Length = 0;
+
+    // Go through all of the shards
+    for (DIC_Shard *Shard = Dict->shards, *EndShard = Dict->shards + Dict->count; Shard < EndShard; ++Shard)
+    {
+        pthread_mutex_lock(&Shard->lock);
+        Length += DIC_DictLength(Shard->dict);
+        pthread_mutex_unlock(&Shard->lock);
+    }
+
+    return Length;
+}
+
+bool DIC_IterateShard(DIC_ShardedDict *Dict, size_t Shard, bool (*Callback)(const char *Key, void *Value, size_t Size, void *Data), void *Data)
+{
+    if (Shard >= Dict->count)
+    {
+        _DIC_SetError(_DIC_ERRORID_ITERATESHARD_NOSHARD, _DIC_ERRORMES_NOSHARD, Shard, Dict->count);
+        return false;
+    }
+
+    DIC_Shard *UseShard = Dict->shards + Shard;
+    bool Result = true;
+
+    pthread_mutex_lock(&UseShard->lock);
+
+    // Go through the entire dict of the shard
+    for (DIC_LinkList **List = UseShard->dict->list, **EndList = UseShard->dict->list + UseShard->dict->length; List < EndList && Result; ++List)
+        for (DIC_LinkList *Link = *List; Link != NULL && Result; Link = Link->next)
+            Result = Callback(Link->key, Link->value, Link->size, Data);
+
+    pthread_mutex_unlock(&UseShard->lock);
+
+    return Result;
+}
+
+#ifdef DIC_LATENCY
+void DIC_SetLatencySampling(uint64_t Rate)
+{
+    __atomic_store_n(&_DIC_LatencyRate, Rate, __ATOMIC_RELAXED);
+}
+
+void DIC_SetLatencyHook(const DIC_SlowHook *Hook)
+{
+    pthread_mutex_lock(&_DIC_LatencyLock);
+
+    // Write the unused slot, the fence makes sure that a thread which sees any of it also sees that the generation of the slot has changed
+    uint64_t Generation = _DIC_LatencyHookGeneration + 1;
+    DIC_SlowHook *Slot = _DIC_LatencyHooks + (Generation & 1);
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&Slot->threshold, (Hook != NULL) ? Hook->threshold : 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&Slot->hook, (Hook != NULL) ? Hook->hook : NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&Slot->data, (Hook != NULL) ? Hook->data : NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&_DIC_LatencyHookGeneration, Generation, __ATOMIC_SEQ_CST);
+
+    // Wait for the other threads which may still be calling the old hook
+    for (DIC_Latency *Latency = _DIC_LatencyList; Latency != NULL; Latency = Latency->next)
+        if (Latency != _DIC_LatencyThread)
+            while (__atomic_load_n(&Latency->inHook, __ATOMIC_SEQ_CST) && __atomic_load_n(&Latency->hookGeneration, __ATOMIC_SEQ_CST) != Generation)
+                sched_yield();
+
+    pthread_mutex_unlock(&_DIC_LatencyLock);
+}
+
+void DIC_SetLatencyAllocator(const DIC_Allocator *Allocator)
+{
+    pthread_mutex_lock(&_DIC_LatencyLock);
+
+    if (Allocator != NULL)
+        _DIC_LatencyAllocator = *Allocator;
+
+    else
+        DIC_InitAllocator(&_DIC_LatencyAllocator);
+
+    pthread_mutex_unlock(&_DIC_LatencyLock);
+}
+
+void DIC_DumpLatency(FILE *File)
+{
+    const char *Names[DIC_OPERATION_COUNT] = {"DIC_AddItem", "DIC_GetItem", "DIC_RemoveItem", "DIC_CheckItem"};
+    const double Quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    uint64_t Counts[_DIC_LATENCYBUCKETS];
+
+    fprintf(File, "%-16s %12s %12s %12s %12s %12s %12s %12s\n", "Operation", "Count", "Mean", "P50", "P90", "P99", "P99.9", "Max");
+
+    pthread_mutex_lock(&_DIC_LatencyLock);
+
+    for (size_t Operation = 0; Operation < DIC_OPERATION_COUNT; ++Operation)
+    {
+        // Combine the histograms of all threads
+        uint64_t Count = 0;
+        uint64_t Total = 0;
+        uint64_t Max = 0;
+
+        memset(Counts, 0, sizeof(Counts));
+        _DIC_LatencyCombine(&_DIC_LatencyRetired, Operation, Counts, &Total, &Max);
+
+        for (DIC_Latency *Latency = _DIC_LatencyList; Latency != NULL; Latency = Latency->next)
+            _DIC_LatencyCombine(Latency, Operation, Counts, &Total, &Max);
+
+        for (size_t Bucket = 0; Bucket < _DIC_LATENCYBUCKETS; ++Bucket)
+            Count += Counts[Bucket];
+
+        fprintf(File, "%-16s %12lu %12lu", Names[Operation], Count, (Count > 0) ? Total / Count : 0);
+
+        // Find the percentiles
+        for (const double *Quantile = Quantiles, *EndQuantile = Quantiles + sizeof(Quantiles) / sizeof(double); Quantile < EndQuantile; ++Quantile)
+        {
+            uint64_t Limit = (uint64_t)(*Quantile * (double)Count);
+            uint64_t Sum = 0;
+            size_t Bucket = 0;
+
+            for (; Bucket < _DIC_LATENCYBUCKETS - 1; ++Bucket)
+            {
+                Sum += Counts[Bucket];
+
+                if (Sum > Limit)
+                    break;
+            }
+
+            fprintf(File, " %12lu", (Count > 0) ? _DIC_LatencyValue(Bucket) : 0);
+        }
+
+        fprintf(File, " %12lu\n", Max);
+    }
+
+    pthread_mutex_unlock(&_DIC_LatencyLock);
+}
+
+void DIC_ResetLatency(void)
+{
+    pthread_mutex_lock(&_DIC_LatencyLock);
+
+    // The histograms of running threads are only written by their own thread so it is asked to clear them
+    for (DIC_Latency *Latency = _DIC_LatencyList; Latency != NULL; Latency = Latency->next)
+        __atomic_add_fetch(&Latency->reset, 1, __ATOMIC_RELEASE);
+
+    memset(_DIC_LatencyRetired.counts, 0, sizeof(_DIC_LatencyRetired.counts));
+    memset(_DIC_LatencyRetired.total, 0, sizeof(_DIC_LatencyRetired.total));
+    memset(_DIC_LatencyRetired.max, 0, sizeof(_DIC_LatencyRetired.max));
+
+    pthread_mutex_unlock(&_DIC_LatencyLock);
+}
+#endif
+
+void DIC_InitLinkList(DIC_LinkList *Struct)
+{
+    Struct->key = NULL;
+    Struct->value = NULL;
+    Struct->size = 0;
+    Struct->pointer = true;
+    Struct->copy = false;
+    Struct->compact = false;
+    Struct->compactValue = false;
+    Struct->next = NULL;
+}
+
+void DIC_InitDict(DIC_Dict *Struct)
+{
+    Struct->list = NULL;
+    Struct->length = 0;
+    Struct->count = 0;
+    Struct->compact = NULL;
+    Struct->compactLoad = 0;
+    Struct->compactMin = 0;
+    DIC_InitAllocator(&Struct->allocator);
+    DIC_InitFilter(&Struct->filter);
+    DIC_InitLog(&Struct->log);
+}
+
+void DIC_InitLog(DIC_Log *Struct)
+{
+    Struct->file = NULL;
+    Struct->buffer = NULL;
+    Struct->used = 0;
+    Struct->size = 0;
+    Struct->records = 0;
+    Struct->batch = 0;
+    Struct->committed = 0;
+    Struct->torn = false;
+}
+
+#ifdef DIC_LATENCY
+void DIC_InitSlowHook(DIC_SlowHook *Struct)
+{
+    Struct->threshold = 0;
+    Struct->hook = NULL;
+    Struct->data = NULL;
+}
+#endif
+
+void DIC_InitFilter(DIC_Filter *Struct)
+{
+    Struct->counters = NULL;
+    Struct->memory = NULL;
+    Struct->count = 0;
+}
+
+void DIC_InitShardedDict(DIC_ShardedDict *Struct)
+{
+    Struct->shards = NULL;
+    Struct->memory = NULL;
+    Struct->count = 0;
+    DIC_InitAllocator(&Struct->allocator);
+}
+
+void DIC_InitAllocator(DIC_Allocator *Struct)
+{
+    Struct->alloc = &_DIC_DefaultAlloc;
+    Struct->realloc = &_DIC_DefaultRealloc;
+    Struct->free = &_DIC_DefaultFree;
+    Struct->context = NULL;
+}
+
+void DIC_DestroyLinkList(DIC_LinkList *LinkList)
+{
+    // Links outside of a dict with a custom allocator use malloc and free
+    DIC_Dict Dict;
+    DIC_InitDict(&Dict);
+
+    _DIC_DestroyLinkList(&Dict, LinkList);
+}
+
+void DIC_DestroyDict(DIC_Dict *Dict)
+{
+    // Write the last records
+    if (Dict->log.file != NULL)
+        DIC_CloseLog(Dict);
+
+    // Destroy the dict
+    if (Dict->list != NULL)
+    {
+        for (DIC_LinkList **List = Dict->list, **EndList = Dict->list + Dict->length; List < EndList; ++List)
+            if (*List != NULL)
+                _DIC_DestroyLinkList(Dict, *List);
+
+        _DIC_FREE(Dict, Dict->list);
+    }
+
+    if (Dict->compact != NULL)
+        _DIC_FREE(Dict, Dict->compact);
+
+    DIC_DetachFilter(Dict);
+
+    // Free the dict with a copy of its allocator
+    DIC_Allocator Allocator = Dict->allocator;
+    Allocator.free(Allocator.context, Dict);
+
+    // Destroy the hash if needed
+    extern HAS_Hash *_DIC_HashTable;
+    extern size_t _DIC_DictCount;
+
+    if (_DIC_DictCount == 0)
+    {
+        _DIC_SetError(_DIC_ERRORID_DESTROYDICT_NODICT, _DIC_ERRORMES_WRONGDICTCOUNT);
+        return;
+    }
+
+    --_DIC_DictCount;
+
+    // Destroy hash
+    if (_DIC_DictCount == 0 && _DIC_HashTable != NULL)
+    {
+        HAS_DestroyHash(_DIC_HashTable);
+        _DIC_HashTable = NULL;
+    }
+}
+
+void DIC_DestroyShardedDict(DIC_ShardedDict *Dict)
+{
+    // Destroy the shards
+    if (Dict->shards != NULL)
+        for (DIC_Shard *Shard = Dict->shards, *EndShard = Dict->shards + Dict->count; Shard < EndShard; ++Shard)
+        {
+            DIC_DestroyDict(Shard->dict);
+            pthread_mutex_destroy(&Shard->lock);
+        }
+
+    if (Dict->memory != NULL)
+        _DIC_FREE(Dict, Dict->memory);
+
+    // Free the dict with a copy of its allocator
+    DIC_Allocator Allocator = Dict->allocator;
+    Allocator.free(Allocator.context, Dict);
 }
 
 #endif
\ No newline at end of file
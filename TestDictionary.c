@@ -1,7 +1,87 @@
 #include <stdio.h>
 #include <string.h>
+
 #include "Dictionary.h"
 
+// Allocator keeping track of the number of allocations
+void *CountAlloc(void *Context, size_t Size)
+{
+    ++*(size_t *)Context;
+    return malloc(Size);
+}
+
+void *CountRealloc(void *Context, void *Pointer, size_t Size)
+{
+    if (Pointer == NULL)
+        ++*(size_t *)Context;
+
+    return realloc(Pointer, Size);
+}
+
+void CountFree(void *Context, void *Pointer)
+{
+    --*(size_t *)Context;
+    free(Pointer);
+}
+
+// Adds items to a sharded dict from a thread
+struct ShardedData {
+    DIC_ShardedDict *dict;
+    uint64_t start;
+    size_t count;
+    bool result;
+};
+
+void *ShardedAdd(void *Data)
+{
+    struct ShardedData *UseData = (struct ShardedData *)Data;
+    char Key[32];
+    UseData->result = true;
+
+    for (uint64_t i = UseData->start, End = UseData->start + UseData->count; i < End; ++i)
+    {
+        sprintf(Key, "Key%lu", i);
+
+        if (!DIC_ShardedAddItem(UseData->dict, Key, &i, sizeof(uint64_t), DIC_MODE_COPY))
+            UseData->result = false;
+    }
+
+    return NULL;
+}
+
+// Looks up and removes missing items in a sharded dict from a thread
+void *ShardedMiss(void *Data)
+{
+    struct ShardedData *UseData = (struct ShardedData *)Data;
+    char Key[32];
+    UseData->result = true;
+
+    for (uint64_t i = UseData->start, End = UseData->start + UseData->count; i < End; ++i)
+    {
+        sprintf(Key, "Missing%lu", i);
+
+        if (DIC_ShardedGetItem(UseData->dict, Key) != NULL || DIC_ShardedRemoveItem(UseData->dict, Key) || DIC_ShardedCheckItem(UseData->dict, Key))
+            UseData->result = false;
+    }
+
+    return NULL;
+}
+
+bool ShardedCountItem(const char *Key, void *Value, size_t Size, void *Data)
+{
+    ++((struct ShardedData *)Data)->count;
+    return true;
+}
+
+void *ShardedCount(void *Data)
+{
+    struct ShardedData *UseData = (struct ShardedData *)Data;
+    UseData->count = 0;
+    UseData->result = DIC_IterateShard(UseData->dict, UseData->start, &ShardedCountItem, UseData);
+
+    return NULL;
+}
+
 int main(int argc, char **argv)
 {
     // Create a dictionary
@@ -227,6 +307,558 @@ int main(int argc, char **argv)
     DIC_DestroyDict(Dict);
     DIC_DestroyDict(CopyDict);
 
+    // Compact a dict after removing most of the items
+    Dict = DIC_CreateDict(64);
+
+    if (Dict == NULL)
+    {
+        printf("Unable to create dictionary: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    for (uint64_t i = 0; i < 100; ++i)
+    {
+        *(uint64_t *)Key = i + 1;
+
+        if (!DIC_AddItem(Dict, Key, &i, sizeof(uint64_t), DIC_MODE_COPY))
+        {
+            printf("Unable to add element %lu to dict: %s\n", i, DIC_GetError());
+            return 0;
+        }
+    }
+
+    for (uint64_t i = 0; i < 90; ++i)
+    {
+        *(uint64_t *)Key = i + 1;
+
+        if (!DIC_RemoveItem(Dict, Key))
+        {
+            printf("Unable to remove element %lu from dict: %s\n", i, DIC_GetError());
+            return 0;
+        }
+    }
+
+    if (!DIC_CompactDict(Dict, 0))
+    {
+        printf("Unable to compact dict: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    if (Dict->length != 10 || DIC_DictLength(Dict) != 10)
+    {
+        printf("Compacted dict has the wrong size (should be 10): %lu, %lu\n", Dict->length, DIC_DictLength(Dict));
+        return 0;
+    }
+
+    for (uint64_t i = 90; i < 100; ++i)
+    {
+        *(uint64_t *)Key = i + 1;
+        uint64_t *CompactValue = (uint64_t *)DIC_GetItem(Dict, Key);
+
+        if (CompactValue == NULL || *CompactValue != i)
+        {
+            printf("Compacted dict lost element %lu\n", i);
+            return 0;
+        }
+    }
+
+    // Let the dict compact itself
+    DIC_SetCompactPolicy(Dict, 0.5, 1);
+
+    for (uint64_t i = 90; i < 96; ++i)
+    {
+        *(uint64_t *)Key = i + 1;
+        DIC_RemoveItem(Dict, Key);
+    }
+
+    *(uint64_t *)Key = 200;
+    DIC_AddItem(Dict, Key, "Value", strlen("Value") + 1, DIC_MODE_COPY);
+
+    if (Dict->length != 4 || DIC_DictLength(Dict) != 5)
+    {
+        printf("Dict was not compacted automatically: %lu, %lu\n", Dict->length, DIC_DictLength(Dict));
+        return 0;
+    }
+
+    printf("Compacted: %s\n", (char *)DIC_GetItem(Dict, Key));
+
+    // Replace and remove compacted values
+    if (!DIC_CompactDict(Dict, 0))
+    {
+        printf("Unable to compact dict: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    *(uint64_t *)Key = 97;
+    DIC_AddItem(Dict, Key, "Replaced", strlen("Replaced") + 1, DIC_MODE_COPY);
+
+    if (!DIC_CompactDict(Dict, 0))
+    {
+        printf("Unable to compact dict: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    Value = DIC_GetItem(Dict, Key);
+
+    if (Value == NULL || strcmp(Value, "Replaced") != 0)
+    {
+        printf("Replaced value was lost when compacting\n");
+        return 0;
+    }
+
+    DIC_AddItem(Dict, Key, "Replaced again", strlen("Replaced again") + 1, DIC_MODE_COPY);
+
+    if (!DIC_RemoveItem(Dict, Key))
+    {
+        printf("Unable to remove compacted element: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    *(uint64_t *)Key = 98;
+
+    if (!DIC_RemoveItem(Dict, Key) || DIC_CheckItem(Dict, Key))
+    {
+        printf("Unable to remove compacted element: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    DIC_DestroyDict(Dict);
+
+    // Refill a dict after it has compacted itself
+    Dict = DIC_CreateDict(1024);
+
+    if (Dict == NULL)
+    {
+        printf("Unable to create dictionary: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    DIC_SetCompactPolicy(Dict, 0.25, 256);
+    char RefillKey[32];
+
+    for (uint64_t i = 0; i < 1000; ++i)
+    {
+        sprintf(RefillKey, "Key%lu", i);
+        DIC_AddItem(Dict, RefillKey, &i, sizeof(uint64_t), DIC_MODE_COPY);
+    }
+
+    for (uint64_t i = 0; i < 999; ++i)
+    {
+        sprintf(RefillKey, "Key%lu", i);
+        DIC_RemoveItem(Dict, RefillKey);
+    }
+
+    if (Dict->length != 256 || DIC_DictLength(Dict) != 1)
+    {
+        printf("Dict was not compacted to its minimum size (should be 256): %lu, %lu\n", Dict->length, DIC_DictLength(Dict));
+        return 0;
+    }
+
+    for (uint64_t i = 1000; i < 2000; ++i)
+    {
+        sprintf(RefillKey, "Key%lu", i);
+
+        if (!DIC_AddItem(Dict, RefillKey, &i, sizeof(uint64_t), DIC_MODE_COPY))
+        {
+            printf("Unable to refill compacted dict: %s\n", DIC_GetError());
+            return 0;
+        }
+    }
+
+    size_t LongestChain = 0;
+
+    for (size_t List = 0; List < Dict->length; ++List)
+    {
+        size_t Chain = 0;
+
+        for (DIC_LinkList *Link = Dict->list[List]; Link != NULL; Link = Link->next)
+            ++Chain;
+
+        if (Chain > LongestChain)
+            LongestChain = Chain;
+    }
+
+    if (DIC_DictLength(Dict) != 1001 || LongestChain > 32)
+    {
+        printf("Refilled dict has the wrong length or too long chains: %lu, %lu\n", DIC_DictLength(Dict), LongestChain);
+        return 0;
+    }
+
+    DIC_DestroyDict(Dict);
+
+    // Destroy links made outside of a dict
+    DIC_LinkList *OwnLink = (DIC_LinkList *)malloc(sizeof(DIC_LinkList));
+    DIC_InitLinkList(OwnLink);
+    OwnLink->key = strdup("Own");
+    OwnLink->value = strdup("Value");
+    OwnLink->pointer = false;
+    DIC_DestroyLinkList(OwnLink);
+
+    // Use a custom allocator
+    size_t AllocCount = 0;
+    DIC_Allocator Allocator = {.alloc = &CountAlloc, .realloc = &CountRealloc, .free = &CountFree, .context = &AllocCount};
+    Dict = DIC_CreateDictEx(8, &Allocator);
+
+    if (Dict == NULL)
+    {
+        printf("Unable to create dictionary with allocator: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    if (!DIC_AddItem(Dict, "First", "Value1", strlen("Value1") + 1, DIC_MODE_COPY) || !DIC_AddItem(Dict, "Second", "Value2", strlen("Value2") + 1, DIC_MODE_COPY))
+    {
+        printf("Unable to add element to dict with allocator: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    // Inserted values are not from the allocator
+    char *InsertValue = (char *)malloc(sizeof(char) * (strlen("Value3") + 1));
+    strcpy(InsertValue, "Value3");
+
+    if (!DIC_AddItem(Dict, "Third", InsertValue, strlen("Value3") + 1, DIC_MODE_INSERT))
+    {
+        printf("Unable to insert element to dict with allocator: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    CopyDict = DIC_CopyDict(Dict);
+
+    if (CopyDict == NULL)
+    {
+        printf("Unable to copy dict with allocator: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    if (AllocCount != 21)
+    {
+        printf("Allocator was not used for everything (should be 21): %lu\n", AllocCount);
+        return 0;
+    }
+
+    DIC_DestroyDict(Dict);
+    DIC_DestroyDict(CopyDict);
+
+    if (AllocCount != 0)
+    {
+        printf("Allocator was not used to free everything: %lu\n", AllocCount);
+        return 0;
+    }
+
+    // Add to a sharded dict from multiple threads
+    DIC_ShardedDict *ShardedDict = DIC_CreateShardedDict(0, 4096, NULL);
+
+    if (ShardedDict != NULL)
+    {
+        printf("Able to create sharded dictionary without shards\n");
+        return 0;
+    }
+
+    printf("Create without shards: %s\n", DIC_GetError());
+
+    ShardedDict = DIC_CreateShardedDict(4, 4096, NULL);
+
+    if (ShardedDict == NULL)
+    {
+        printf("Unable to create sharded dictionary: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    pthread_t Threads[4];
+    struct ShardedData ThreadData[4];
+
+    for (size_t i = 0; i < 4; ++i)
+    {
+        ThreadData[i] = (struct ShardedData){.dict = ShardedDict, .start = 1000 * i, .count = 1000, .result = false};
+        pthread_create(Threads + i, NULL, &ShardedAdd, ThreadData + i);
+    }
+
+    for (size_t i = 0; i < 4; ++i)
+    {
+        pthread_join(Threads[i], NULL);
+
+        if (!ThreadData[i].result)
+        {
+            printf("Unable to add to sharded dict from thread %lu\n", i);
+            return 0;
+        }
+    }
+
+    if (DIC_ShardedDictLength(ShardedDict) != 4000)
+    {
+        printf("Sharded dict has the wrong length (should be 4000): %lu\n", DIC_ShardedDictLength(ShardedDict));
+        return 0;
+    }
+
+    uint64_t *ShardedValue = (uint64_t *)DIC_ShardedGetItem(ShardedDict, "Key1234");
+
+    if (ShardedValue == NULL || *ShardedValue != 1234)
+    {
+        printf("Unable to get value from sharded dict: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    if (!DIC_ShardedRemoveItem(ShardedDict, "Key1234") || DIC_ShardedCheckItem(ShardedDict, "Key1234"))
+    {
+        printf("Unable to remove value from sharded dict: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    // Miss from multiple threads
+    for (size_t i = 0; i < 4; ++i)
+    {
+        ThreadData[i] = (struct ShardedData){.dict = ShardedDict, .start = 1000 * i, .count = 1000, .result = false};
+        pthread_create(Threads + i, NULL, &ShardedMiss, ThreadData + i);
+    }
+
+    for (size_t i = 0; i < 4; ++i)
+    {
+        pthread_join(Threads[i], NULL);
+
+        if (!ThreadData[i].result)
+        {
+            printf("Found missing items in sharded dict from thread %lu\n", i);
+            return 0;
+        }
+    }
+
+    if (DIC_IterateShard(ShardedDict, 4, &ShardedCountItem, ThreadData))
+    {
+        printf("Able to iterate a shard which does not exist\n");
+        return 0;
+    }
+
+    printf("Iterate missing shard: %s\n", DIC_GetError());
+
+    // Iterate the shards from multiple threads
+    for (size_t i = 0; i < 4; ++i)
+    {
+        ThreadData[i] = (struct ShardedData){.dict = ShardedDict, .start = i, .count = 0, .result = false};
+        pthread_create(Threads + i, NULL, &ShardedCount, ThreadData + i);
+    }
+
+    size_t ShardedLength = 0;
+
+    for (size_t i = 0; i < 4; ++i)
+    {
+        pthread_join(Threads[i], NULL);
+        printf("Shard: %lu, Count: %lu\n", i, ThreadData[i].count);
+        ShardedLength += ThreadData[i].count;
+    }
+
+    if (ShardedLength != 3999)
+    {
+        printf("Iterated the wrong number of items (should be 3999): %lu\n", ShardedLength);
+        return 0;
+    }
+
+    DIC_DestroyShardedDict(ShardedDict);
+
+    // Use a filter for missing keys
+    Dict = DIC_CreateDict(1024);
+
+    if (Dict == NULL)
+    {
+        printf("Unable to create dictionary: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    char FilterKey[32];
+
+    for (uint64_t i = 0; i < 500; ++i)
+    {
+        sprintf(FilterKey, "Key%lu", i);
+        DIC_AddItem(Dict, FilterKey, NULL, 0, DIC_MODE_POINTER);
+    }
+
+    if (!DIC_AttachFilter(Dict, 1000))
+    {
+        printf("Unable to attach filter: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    for (uint64_t i = 500; i < 1000; ++i)
+    {
+        sprintf(FilterKey, "Key%lu", i);
+        DIC_AddItem(Dict, FilterKey, NULL, 0, DIC_MODE_POINTER);
+    }
+
+    for (uint64_t i = 0; i < 100; ++i)
+    {
+        sprintf(FilterKey, "Key%lu", i);
+        DIC_RemoveItem(Dict, FilterKey);
+    }
+
+    DIC_Dict *FilterCopy = DIC_CopyDict(Dict);
+
+    if (FilterCopy == NULL)
+    {
+        printf("Unable to copy dict with filter: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    for (uint64_t i = 0; i < 1000; ++i)
+    {
+        sprintf(FilterKey, "Key%lu", i);
+
+        if (DIC_CheckItem(Dict, FilterKey) != (i >= 100) || DIC_CheckItem(FilterCopy, FilterKey) != (i >= 100))
+        {
+            printf("Filter gave the wrong answer for element %lu\n", i);
+            return 0;
+        }
+    }
+
+    // Find the false positive rate
+    size_t FalsePositives = 0;
+
+    for (uint64_t i = 1000; i < 11000; ++i)
+    {
+        sprintf(FilterKey, "Key%lu", i);
+
+        if (_DIC_FilterUpdate(&Dict->filter, HAS_HashValue(_DIC_HashTable, (uint8_t *)FilterKey, strlen(FilterKey)), 0))
+            ++FalsePositives;
+    }
+
+    printf("Filter false positives: %lu / 10000\n", FalsePositives);
+
+    DIC_DestroyDict(Dict);
+    DIC_DestroyDict(FilterCopy);
+
+    // Save changes to a snapshot and a log
+    remove("TestDictionary.snapshot");
+    remove("TestDictionary.log");
+
+    Dict = DIC_CreateDict(16);
+
+    if (Dict == NULL)
+    {
+        printf("Unable to create dictionary: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    if (!DIC_AttachFilter(Dict, 100) || !DIC_OpenLog(Dict, "TestDictionary.log", 4))
+    {
+        printf("Unable to open log: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    for (uint64_t i = 0; i < 20; ++i)
+    {
+        sprintf(FilterKey, "Key%lu", i);
+
+        if (!DIC_AddItem(Dict, FilterKey, &i, sizeof(uint64_t), DIC_MODE_COPY))
+        {
+            printf("Unable to add element %lu to logged dict: %s\n", i, DIC_GetError());
+            return 0;
+        }
+
+        // The record filling a batch writes it right away
+        if (i == 3)
+        {
+            FILE *LogFile = fopen("TestDictionary.log", "rb");
+            fseek(LogFile, 0, SEEK_END);
+            long LogSize = ftell(LogFile);
+            fclose(LogFile);
+
+            if (LogSize != 8 + 4 * 25)
+            {
+                printf("Full batch was not written to the log (size should be 108): %ld\n", LogSize);
+                return 0;
+            }
+        }
+    }
+
+    DIC_RemoveItem(Dict, "Key0");
+    DIC_AddItem(Dict, "Pointer", Dict, 0, DIC_MODE_POINTER);
+
+    if (!DIC_CompactLog(Dict, "TestDictionary.snapshot"))
+    {
+        printf("Unable to compact log: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    uint64_t LogValue = 100;
+    DIC_AddItem(Dict, "After", &LogValue, sizeof(uint64_t), DIC_MODE_COPY);
+    DIC_AddItem(Dict, "Key4", &LogValue, sizeof(uint64_t), DIC_MODE_COPY);
+    DIC_AddItem(Dict, "Key5", Dict, 0, DIC_MODE_POINTER);
+    DIC_RemoveItem(Dict, "Key3");
+    DIC_RemoveItem(Dict, "Pointer");
+
+    if (!DIC_CloseLog(Dict))
+    {
+        printf("Unable to close log: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    DIC_DestroyDict(Dict);
+
+    // Leave a partial record like a crash would
+    FILE *LogFile = fopen("TestDictionary.log", "ab");
+    fwrite("\x01\x05\x00", sizeof(char), 3, LogFile);
+    fclose(LogFile);
+
+    // Recover the dict
+    Dict = DIC_RecoverDict("TestDictionary.snapshot", "TestDictionary.log", 16, NULL);
+
+    if (Dict == NULL)
+    {
+        printf("Unable to recover dict: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    if (DIC_DictLength(Dict) != 18 || Dict->filter.count == 0)
+    {
+        printf("Recovered dict has the wrong length (should be 18): %lu\n", DIC_DictLength(Dict));
+        return 0;
+    }
+
+    for (uint64_t i = 0; i < 20; ++i)
+    {
+        sprintf(FilterKey, "Key%lu", i);
+        uint64_t *RecoveredValue = (uint64_t *)DIC_GetItem(Dict, FilterKey);
+        uint64_t Expected = (i == 4) ? 100 : i;
+
+        if ((i == 0 || i == 3 || i == 5) != (RecoveredValue == NULL) || (RecoveredValue != NULL && *RecoveredValue != Expected))
+        {
+            printf("Recovered dict has the wrong value for element %lu\n", i);
+            return 0;
+        }
+    }
+
+    if (DIC_CheckItem(Dict, "Pointer") || !DIC_CheckItem(Dict, "After"))
+    {
+        printf("Recovered dict has the wrong items\n");
+        return 0;
+    }
+
+    DIC_DestroyDict(Dict);
+
+    // Reopen the log after the crash, the new records must not be lost behind the partial record
+    Dict = DIC_RecoverDict("TestDictionary.snapshot", "TestDictionary.log", 16, NULL);
+
+    if (Dict == NULL || !DIC_OpenLog(Dict, "TestDictionary.log", 4))
+    {
+        printf("Unable to reopen log: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    DIC_AddItem(Dict, "Reopened1", &LogValue, sizeof(uint64_t), DIC_MODE_COPY);
+    DIC_AddItem(Dict, "Reopened2", &LogValue, sizeof(uint64_t), DIC_MODE_COPY);
+    DIC_CloseLog(Dict);
+    DIC_DestroyDict(Dict);
+
+    Dict = DIC_RecoverDict("TestDictionary.snapshot", "TestDictionary.log", 16, NULL);
+
+    if (Dict == NULL || DIC_DictLength(Dict) != 20 || !DIC_CheckItem(Dict, "Reopened1") || !DIC_CheckItem(Dict, "Reopened2"))
+    {
+        printf("Records added after reopening the log were lost: %lu\n", (Dict != NULL) ? DIC_DictLength(Dict) : 0);
+        return 0;
+    }
+
+    DIC_DestroyDict(Dict);
+
+    remove("TestDictionary.snapshot");
+    remove("TestDictionary.log");
+
     printf("Finished without errors\n");
 
     return 0;
@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <string.h>
+
+#define DIC_LATENCY
+#include "Dictionary.h"
+
+// Allocator keeping track of the number of allocations
+void *CountAlloc(void *Context, size_t Size)
+{
+    ++*(size_t *)Context;
+    return malloc(Size);
+}
+
+void *CountRealloc(void *Context, void *Pointer, size_t Size)
+{
+    if (Pointer == NULL)
+        ++*(size_t *)Context;
+
+    return realloc(Pointer, Size);
+}
+
+void CountFree(void *Context, void *Pointer)
+{
+    --*(size_t *)Context;
+    free(Pointer);
+}
+
+// Counts the slow operations
+void CountSlow(DIC_Operation Operation, const char *Key, size_t ChainLength, uint64_t Ticks, void *Data)
+{
+    if (Operation == DIC_OPERATION_GETITEM && ChainLength > 0)
+        ++*(size_t *)Data;
+}
+
+// Gets items from a thread which exits afterwards
+void *TimedGet(void *Data)
+{
+    char Key[32];
+
+    for (uint64_t i = 0; i < 50; ++i)
+    {
+        sprintf(Key, "Key%lu", i);
+        DIC_GetItem((DIC_Dict *)Data, Key);
+    }
+
+    return NULL;
+}
+
+// Slow hook which takes a while, keeps track of how many threads are inside it
+size_t BusyCount = 0;
+
+void BusySlow(DIC_Operation Operation, const char *Key, size_t ChainLength, uint64_t Ticks, void *Data)
+{
+    __atomic_add_fetch(&BusyCount, 1, __ATOMIC_SEQ_CST);
+    usleep(1000);
+    __atomic_sub_fetch(&BusyCount, 1, __ATOMIC_SEQ_CST);
+}
+
+// Gets items from a thread until told to stop
+struct BusyData {
+    DIC_Dict *dict;
+    bool stop;
+};
+
+void *BusyGet(void *Data)
+{
+    struct BusyData *UseData = (struct BusyData *)Data;
+
+    while (!__atomic_load_n(&UseData->stop, __ATOMIC_SEQ_CST))
+        DIC_GetItem(UseData->dict, "Key0");
+
+    return NULL;
+}
+
+// Counts the samples of one operation in a histogram
+uint64_t CountSamples(DIC_Latency *Latency, DIC_Operation Operation)
+{
+    uint64_t Count = 0;
+
+    for (size_t Bucket = 0; Bucket < _DIC_LATENCYBUCKETS; ++Bucket)
+        Count += Latency->counts[Operation][Bucket];
+
+    return Count;
+}
+
+int main(int argc, char **argv)
+{
+    // Time the operations
+    DIC_Dict *Dict = DIC_CreateDict(16);
+    char Key[32];
+
+    if (Dict == NULL)
+    {
+        printf("Unable to create dictionary: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    size_t SlowCount = 0;
+    DIC_SlowHook Hook;
+    DIC_InitSlowHook(&Hook);
+    Hook.hook = &CountSlow;
+    Hook.data = &SlowCount;
+
+    DIC_ResetLatency();
+    DIC_SetLatencyHook(&Hook);
+
+    // The hook is copied so the struct may be changed afterwards
+    DIC_InitSlowHook(&Hook);
+
+    for (uint64_t i = 0; i < 100; ++i)
+    {
+        sprintf(Key, "Key%lu", i);
+        DIC_AddItem(Dict, Key, NULL, 0, DIC_MODE_POINTER);
+        DIC_GetItem(Dict, Key);
+    }
+
+    DIC_SetLatencySampling(10);
+
+    for (uint64_t i = 0; i < 100; ++i)
+    {
+        sprintf(Key, "Key%lu", i);
+        DIC_GetItem(Dict, Key);
+    }
+
+    if (SlowCount != 110)
+    {
+        printf("Slow hook was called the wrong number of times (should be 110): %lu\n", SlowCount);
+        return 0;
+    }
+
+    DIC_SetLatencyHook(NULL);
+    DIC_SetLatencySampling(1);
+
+    // Reset, the histograms of this thread are left out until it clears them
+    DIC_ResetLatency();
+
+    if (_DIC_LatencyList == NULL || _DIC_LatencyList->cleared == _DIC_LatencyList->reset)
+    {
+        printf("Reset did not ask the thread to clear its histograms\n");
+        return 0;
+    }
+
+    DIC_GetItem(Dict, "Key0");
+
+    if (CountSamples(_DIC_LatencyList, DIC_OPERATION_GETITEM) != 1 || CountSamples(_DIC_LatencyList, DIC_OPERATION_ADDITEM) != 0)
+    {
+        printf("Histograms were not cleared after reset\n");
+        return 0;
+    }
+
+    // Time from a thread which exits, its histograms must be freed with the allocator
+    size_t AllocCount = 0;
+    DIC_Allocator Allocator = {.alloc = &CountAlloc, .realloc = &CountRealloc, .free = &CountFree, .context = &AllocCount};
+    DIC_SetLatencyAllocator(&Allocator);
+
+    pthread_t Thread;
+    pthread_create(&Thread, NULL, &TimedGet, Dict);
+    pthread_join(Thread, NULL);
+
+    DIC_SetLatencyAllocator(NULL);
+
+    if (AllocCount != 0)
+    {
+        printf("Histograms of exited thread were not freed: %lu\n", AllocCount);
+        return 0;
+    }
+
+    if (_DIC_LatencyList == NULL || _DIC_LatencyList->next != NULL)
+    {
+        printf("Histograms of exited thread are still in the list\n");
+        return 0;
+    }
+
+    if (CountSamples(&_DIC_LatencyRetired, DIC_OPERATION_GETITEM) != 50)
+    {
+        printf("Samples of exited thread were not kept (should be 50): %lu\n", CountSamples(&_DIC_LatencyRetired, DIC_OPERATION_GETITEM));
+        return 0;
+    }
+
+    // Time lookups in a sharded dict
+    DIC_ShardedDict *ShardedDict = DIC_CreateShardedDict(2, 16, NULL);
+
+    if (ShardedDict == NULL)
+    {
+        printf("Unable to create sharded dictionary: %s\n", DIC_GetError());
+        return 0;
+    }
+
+    uint64_t GetCount = CountSamples(_DIC_LatencyList, DIC_OPERATION_GETITEM);
+    uint64_t CheckCount = CountSamples(_DIC_LatencyList, DIC_OPERATION_CHECKITEM);
+    DIC_ShardedAddItem(ShardedDict, "Sharded", NULL, 0, DIC_MODE_POINTER);
+    DIC_ShardedGetItem(ShardedDict, "Sharded");
+    DIC_ShardedGetItem(ShardedDict, "Missing");
+    DIC_ShardedCheckItem(ShardedDict, "Sharded");
+
+    if (CountSamples(_DIC_LatencyList, DIC_OPERATION_GETITEM) != GetCount + 2 || CountSamples(_DIC_LatencyList, DIC_OPERATION_CHECKITEM) != CheckCount + 1)
+    {
+        printf("Sharded lookups were not timed\n");
+        return 0;
+    }
+
+    DIC_DestroyShardedDict(ShardedDict);
+
+    DIC_DumpLatency(stdout);
+
+    // Replacing the hook waits for other threads calling the old hook
+    Hook.hook = &BusySlow;
+    DIC_SetLatencyHook(&Hook);
+
+    struct BusyData Busy = {.dict = Dict, .stop = false};
+    pthread_create(&Thread, NULL, &BusyGet, &Busy);
+
+    while (__atomic_load_n(&BusyCount, __ATOMIC_SEQ_CST) == 0)
+        sched_yield();
+
+    DIC_SetLatencyHook(NULL);
+    size_t BusyAfter = __atomic_load_n(&BusyCount, __ATOMIC_SEQ_CST);
+
+    __atomic_store_n(&Busy.stop, true, __ATOMIC_SEQ_CST);
+    pthread_join(Thread, NULL);
+
+    if (BusyAfter != 0)
+    {
+        printf("Old hook was still running after it was replaced\n");
+        return 0;
+    }
+
+    DIC_ResetLatency();
+
+    if (CountSamples(&_DIC_LatencyRetired, DIC_OPERATION_GETITEM) != 0)
+    {
+        printf("Samples of exited thread were not reset\n");
+        return 0;
+    }
+
+    DIC_DestroyDict(Dict);
+
+    printf("Finished without errors\n");
+
+    return 0;
+}
\ No newline at end of file